@@ -13,420 +13,3618 @@
 #include <fcntl.h>
 #include <filesystem>
 #include <thread>
+#include <atomic>
+#include <mutex>
+#include <unordered_set>
+#include <unordered_map>
+#include <map>
+#include <shared_mutex>
+#include <chrono>
+#include <condition_variable>
+#include <memory>
+#include <functional>
+#include <csignal>
+#include <cstdio>
+#include <cerrno>
+#include <climits>
+#include <utility>
+#include <charconv>
+#include <system_error>
+#include <sys/syscall.h>
+#include <sys/resource.h>
 
 using namespace std;
 namespace fs = filesystem;
 
+// Stop token and progress counters shared by a command's worker tasks, the shell and the jobs listing
+struct JobContext {
+    std::atomic<bool> stopRequested{false};
+    std::atomic<unsigned long long> bytesDone{0};
+    std::atomic<unsigned long long> filesDone{0};
+    std::atomic<unsigned long long> throttledNanoseconds{0};
+    std::chrono::steady_clock::time_point startTime = std::chrono::steady_clock::now();
+
+    // Set by any worker whose entry could not be processed, so a finished job is reported as failed
+    std::atomic<bool> failed{false};
+
+    // Closing report set by the command before it returns, printed once the progress line is gone
+    std::string summary;
+
+    // Function checked by every worker task before and during its work
+    bool stopped() const {
+        return stopRequested.load(std::memory_order_relaxed);
+    }
+
+    // Function to report errno for a command and mark the command as failed
+    void fail(const char* command) {
+        perror(command);
+        failed.store(true, std::memory_order_relaxed);
+    }
+
+    // Function to format the average bytes/s and files/s since the command started
+    std::string progress() const {
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - startTime).count();
+        if (seconds <= 0) {
+            seconds = 1e-9;
+        }
+
+        double bytesPerSecond = bytesDone / seconds;
+        const char* units[] = {"B/s", "KB/s", "MB/s", "GB/s"};
+        int unit = 0;
+        while (bytesPerSecond >= 1024 && unit < 3) {
+            bytesPerSecond /= 1024;
+            ++unit;
+        }
+
+        char line[160];
+        int length = snprintf(line, sizeof(line), "%.1f %s, %.1f files/s (%llu files)", bytesPerSecond, units[unit],
+                              filesDone / seconds, filesDone.load());
+        if (throttledNanoseconds > 0 && length < static_cast<int>(sizeof(line))) {
+            snprintf(line + length, sizeof(line) - length, ", throttled %.1fs", throttledNanoseconds / 1e9);
+        }
+        return line;
+    }
+};
+
+// Runs tasks on threads of their own, the way the recursive commands fan out over directory entries, but caps
+// the threads alive across the whole shell. Past the cap, or when the system refuses another thread, a task runs
+// on the calling thread instead, so traversals of millions of entries never exhaust threads or wait on each other.
+class TaskGroup {
+public:
+    // Threads allowed to exist at once across all task groups
+    static const int MAX_THREADS = 256;
+
+    TaskGroup() = default;
+    TaskGroup(const TaskGroup&) = delete;
+    TaskGroup& operator=(const TaskGroup&) = delete;
+
+    ~TaskGroup() {
+        wait();
+    }
+
+    // Function to start a task on a new thread if one is available, otherwise to run it right away
+    template <typename Task>
+    void run(Task task) {
+        if (reserveThread() || (reapFinished() && reserveThread())) {
+            auto done = std::make_shared<std::atomic<bool>>(false);
+            try {
+                std::thread worker([task, done]() mutable {
+                    task();
+                    done->store(true);
+                });
+                workers.push_back(Worker{std::move(worker), done});
+                return;
+            } catch (const std::system_error&) {
+                liveThreads--;
+            }
+        }
+        task();
+    }
+
+    // Function to wait for every task started by this group
+    void wait() {
+        for (auto& worker : workers) {
+            worker.thread.join();
+            liveThreads--;
+        }
+        workers.clear();
+    }
+
+private:
+    struct Worker {
+        std::thread thread;
+        std::shared_ptr<std::atomic<bool>> done;
+    };
+
+    // A finished thread still holds its stack until joined, so slots are only given back on join
+    static inline std::atomic<int> liveThreads{0};
+    std::vector<Worker> workers;
+
+    static bool reserveThread() {
+        if (++liveThreads <= MAX_THREADS) {
+            return true;
+        }
+        liveThreads--;
+        return false;
+    }
+
+    // Function to join this group's finished threads; returns true if that freed any slot
+    bool reapFinished() {
+        size_t before = workers.size();
+        workers.erase(std::remove_if(workers.begin(), workers.end(),
+                                     [](Worker& worker) {
+                                         if (!worker.done->load()) {
+                                             return false;
+                                         }
+                                         worker.thread.join();
+                                         liveThreads--;
+                                         return true;
+                                     }),
+                      workers.end());
+        return workers.size() < before;
+    }
+};
+
+// Metadata of a filesystem entry as reported by a FileSystem backend
+struct FileInfo {
+    enum class Type { Regular, Directory, Symlink, Other };
+
+    Type type = Type::Other;
+    unsigned int mode = 0;
+    unsigned long long size = 0;
+    unsigned long long inode = 0;
+    unsigned long long device = 0;
+    unsigned long long linkCount = 1;
+    unsigned int owner = 0;
+    long long mtimeSeconds = 0;
+    long mtimeNanoseconds = 0;
+};
+
+// One name in a directory listing; info holds only the type unless full metadata was requested
+struct DirectoryEntry {
+    std::string name;
+    FileInfo info;
+};
+
+// Open file on a FileSystem backend; failed calls return -1 or false and set errno
+class FileHandle {
+public:
+    virtual ~FileHandle() = default;
+    virtual ssize_t read(char* buffer, size_t length) = 0;
+    virtual ssize_t write(const char* buffer, size_t length) = 0;
+    virtual bool sync() = 0;
+    virtual bool close() = 0;
+};
+
+// Filesystem operations used by ls, mv, rm, cp and cd. Like the POSIX calls they
+// replace, failed operations return false (or null) and set errno, so callers keep using perror.
+class FileSystem {
+public:
+    enum class OpenMode { Read, Write, Append };
+
+    virtual ~FileSystem() = default;
+
+    virtual const char* name() const = 0;
+    virtual bool stat(const std::string& path, FileInfo& info, bool followLinks = true) = 0;
+    virtual bool listDirectory(const std::string& path, std::vector<DirectoryEntry>& entries, bool withInfo) = 0;
+    virtual std::unique_ptr<FileHandle> open(const std::string& path, OpenMode mode) = 0;
+    virtual bool makeDirectory(const std::string& path, unsigned int mode) = 0;
+    virtual bool rename(const std::string& from, const std::string& to) = 0;
+    virtual bool remove(const std::string& path) = 0;
+    virtual bool link(const std::string& target, const std::string& path) = 0;
+    virtual bool syncDirectory(const std::string& path) = 0;
+    virtual bool changeDirectory(const std::string& path) = 0;
+    virtual std::string currentDirectory() = 0;
+
+    bool exists(const std::string& path) {
+        FileInfo info;
+        return stat(path, info, false);
+    }
+
+    bool isDirectory(const std::string& path) {
+        FileInfo info;
+        return stat(path, info) && info.type == FileInfo::Type::Directory;
+    }
+
+    // Function to create a directory and any missing parents, like fs::create_directories
+    bool makeDirectories(const std::string& path) {
+        fs::path partial;
+        for (const auto& component : fs::path(path)) {
+            partial /= component;
+            if (!makeDirectory(partial.string(), 0755) && errno != EEXIST) {
+                return false;
+            }
+        }
+        return isDirectory(path);
+    }
+
+    // Function to delete name inside directory and everything below it without following symbolic links,
+    // calling beforeRemove ahead of every unlink or rmdir and stopping when it returns false. This version
+    // works by path; backends where a directory can be swapped for a symbolic link meanwhile override it.
+    virtual bool removeTree(const std::string& directory, const std::string& name,
+                            const std::function<bool()>& beforeRemove) {
+        const std::string path = directory + "/" + name;
+        FileInfo info;
+        if (!stat(path, info, false)) {
+            return errno == ENOENT;
+        }
+
+        if (info.type == FileInfo::Type::Directory) {
+            std::vector<DirectoryEntry> entries;
+            listDirectory(path, entries, false);
+            for (const DirectoryEntry& entry : entries) {
+                if (!removeTree(path, entry.name, beforeRemove)) {
+                    return false;
+                }
+            }
+        }
+
+        if (!beforeRemove()) {
+            return false;
+        }
+        return remove(path) || errno == ENOENT;
+    }
+};
+
+// File opened through PosixFileSystem
+class PosixFileHandle : public FileHandle {
+public:
+    explicit PosixFileHandle(int fd) : fd(fd) {}
+
+    ~PosixFileHandle() override {
+        close();
+    }
+
+    ssize_t read(char* buffer, size_t length) override {
+        return ::read(fd, buffer, length);
+    }
+
+    ssize_t write(const char* buffer, size_t length) override {
+        return ::write(fd, buffer, length);
+    }
+
+    bool sync() override {
+        return fdatasync(fd) == 0;
+    }
+
+    bool close() override {
+        if (fd < 0) {
+            return true;
+        }
+        int result = ::close(fd);
+        fd = -1;
+        return result == 0;
+    }
+
+private:
+    int fd;
+};
+
+// Backend that maps every operation onto the POSIX call the commands used to make directly
+class PosixFileSystem : public FileSystem {
+public:
+    const char* name() const override {
+        return "posix";
+    }
+
+    bool stat(const std::string& path, FileInfo& info, bool followLinks) override {
+        struct stat fileStat;
+        if ((followLinks ? ::stat(path.c_str(), &fileStat) : lstat(path.c_str(), &fileStat)) != 0) {
+            return false;
+        }
+        fillInfo(fileStat, info);
+        return true;
+    }
+
+    bool listDirectory(const std::string& path, std::vector<DirectoryEntry>& entries, bool withInfo) override {
+        DIR* dir = opendir(path.c_str());
+        if (dir == NULL) {
+            return false;
+        }
+
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) {
+                continue;
+            }
+
+            DirectoryEntry listed;
+            listed.name = entry->d_name;
+
+            // fstatat on the open directory avoids resolving the full path again for every entry
+            struct stat fileStat;
+            if (withInfo || entry->d_type == DT_UNKNOWN) {
+                if (fstatat(dirfd(dir), entry->d_name, &fileStat, AT_SYMLINK_NOFOLLOW) != 0) {
+                    continue;
+                }
+                fillInfo(fileStat, listed.info);
+            } else {
+                listed.info.type = entry->d_type == DT_DIR   ? FileInfo::Type::Directory
+                                   : entry->d_type == DT_REG ? FileInfo::Type::Regular
+                                   : entry->d_type == DT_LNK ? FileInfo::Type::Symlink
+                                                             : FileInfo::Type::Other;
+            }
+            entries.push_back(std::move(listed));
+        }
+        closedir(dir);
+        return true;
+    }
+
+    std::unique_ptr<FileHandle> open(const std::string& path, OpenMode mode) override {
+        int flags = mode == OpenMode::Read    ? O_RDONLY
+                    : mode == OpenMode::Write ? O_WRONLY | O_CREAT | O_TRUNC
+                                              : O_WRONLY | O_CREAT | O_APPEND;
+        int fd = ::open(path.c_str(), flags, 0644);
+        if (fd < 0) {
+            return nullptr;
+        }
+        return std::make_unique<PosixFileHandle>(fd);
+    }
+
+    bool makeDirectory(const std::string& path, unsigned int mode) override {
+        return mkdir(path.c_str(), mode) == 0;
+    }
+
+    bool rename(const std::string& from, const std::string& to) override {
+        return ::rename(from.c_str(), to.c_str()) == 0;
+    }
+
+    bool remove(const std::string& path) override {
+        return ::remove(path.c_str()) == 0;
+    }
+
+    bool link(const std::string& target, const std::string& path) override {
+        return ::link(target.c_str(), path.c_str()) == 0;
+    }
+
+    bool syncDirectory(const std::string& path) override {
+        int fd = ::open(path.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (fd < 0) {
+            return false;
+        }
+        bool synced = fsync(fd) == 0;
+        ::close(fd);
+        return synced;
+    }
+
+    bool changeDirectory(const std::string& path) override {
+        return chdir(path.c_str()) == 0;
+    }
+
+    std::string currentDirectory() override {
+        std::error_code error;
+        return fs::current_path(error).string();
+    }
+
+    bool removeTree(const std::string& directory, const std::string& name,
+                    const std::function<bool()>& beforeRemove) override {
+        int directoryFd = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (directoryFd < 0) {
+            return false;
+        }
+        bool removed = removeTreeAt(directoryFd, name.c_str(), beforeRemove);
+        ::close(directoryFd);
+        return removed;
+    }
+
+private:
+    // Function to delete name below an open directory. Every step is relative to a descriptor opened
+    // with O_NOFOLLOW, so a directory swapped for a symbolic link is unlinked instead of followed.
+    static bool removeTreeAt(int directoryFd, const char* name, const std::function<bool()>& beforeRemove) {
+        int childFd = openat(directoryFd, name, O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+        if (childFd < 0) {
+            if (errno == ENOENT) {
+                return true;
+            }
+            if (errno != ENOTDIR && errno != ELOOP) {
+                return false;
+            }
+            if (!beforeRemove()) {
+                return false;
+            }
+            return unlinkat(directoryFd, name, 0) == 0 || errno == ENOENT;
+        }
+
+        DIR* dir = fdopendir(childFd);
+        if (dir == NULL) {
+            ::close(childFd);
+            return false;
+        }
+
+        // Names are collected first, since removing entries while reading the directory may skip some
+        std::vector<std::string> names;
+        struct dirent* entry;
+        while ((entry = readdir(dir)) != NULL) {
+            if (strcmp(entry->d_name, ".") != 0 && strcmp(entry->d_name, "..") != 0) {
+                names.push_back(entry->d_name);
+            }
+        }
+
+        bool removed = true;
+        for (const std::string& childName : names) {
+            if (!removeTreeAt(dirfd(dir), childName.c_str(), beforeRemove)) {
+                removed = false;
+                break;
+            }
+        }
+        closedir(dir);
+
+        if (!removed || !beforeRemove()) {
+            return false;
+        }
+        return unlinkat(directoryFd, name, AT_REMOVEDIR) == 0 || errno == ENOENT;
+    }
+
+    static void fillInfo(const struct stat& fileStat, FileInfo& info) {
+        info.type = S_ISREG(fileStat.st_mode)   ? FileInfo::Type::Regular
+                    : S_ISDIR(fileStat.st_mode) ? FileInfo::Type::Directory
+                    : S_ISLNK(fileStat.st_mode) ? FileInfo::Type::Symlink
+                                                : FileInfo::Type::Other;
+        info.mode = fileStat.st_mode & 07777;
+        info.size = fileStat.st_size;
+        info.inode = fileStat.st_ino;
+        info.device = fileStat.st_dev;
+        info.linkCount = fileStat.st_nlink;
+        info.owner = fileStat.st_uid;
+        info.mtimeSeconds = fileStat.st_mtim.tv_sec;
+        info.mtimeNanoseconds = fileStat.st_mtim.tv_nsec;
+    }
+};
+
+// Thread-safe in-memory backend for measuring the commands' own CPU cost. Every operation can
+// be given a simulated latency, which is slept before taking the lock so concurrent callers overlap.
+class MemoryFileSystem : public FileSystem {
+public:
+    explicit MemoryFileSystem(std::chrono::microseconds latency = std::chrono::microseconds(0))
+        : latency(latency), root(std::make_shared<Node>()) {
+        root->info.type = FileInfo::Type::Directory;
+        root->info.mode = 0755;
+        root->info.inode = nextInode++;
+        root->info.owner = getuid();
+    }
+
+    const char* name() const override {
+        return "memory";
+    }
+
+    bool stat(const std::string& path, FileInfo& info, bool) override {
+        simulateLatency();
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        std::shared_ptr<Node> node = resolve(path);
+        if (!node) {
+            return false;
+        }
+        info = node->info;
+        info.size = node->data.size();
+        return true;
+    }
+
+    bool listDirectory(const std::string& path, std::vector<DirectoryEntry>& entries, bool) override {
+        simulateLatency();
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        std::shared_ptr<Node> node = resolveDirectory(path);
+        if (!node) {
+            return false;
+        }
+
+        entries.reserve(entries.size() + node->children.size());
+        for (const auto& child : node->children) {
+            DirectoryEntry listed;
+            listed.name = child.first;
+            listed.info = child.second->info;
+            listed.info.size = child.second->data.size();
+            entries.push_back(std::move(listed));
+        }
+        return true;
+    }
+
+    std::unique_ptr<FileHandle> open(const std::string& path, OpenMode mode) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::shared_ptr<Node> node = resolve(path);
+        if (!node && mode != OpenMode::Read) {
+            std::string name;
+            std::shared_ptr<Node> parent = resolveParent(path, name);
+            if (!parent) {
+                return nullptr;
+            }
+            node = std::make_shared<Node>();
+            node->info.type = FileInfo::Type::Regular;
+            node->info.mode = 0644;
+            node->info.inode = nextInode++;
+            node->info.owner = getuid();
+            touch(*node);
+            parent->children[name] = node;
+        }
+        if (!node) {
+            return nullptr;
+        }
+        if (node->info.type == FileInfo::Type::Directory) {
+            errno = EISDIR;
+            return nullptr;
+        }
+        if (mode == OpenMode::Write) {
+            node->data.clear();
+            touch(*node);
+        }
+        return std::make_unique<MemoryFileHandle>(*this, node, mode == OpenMode::Append ? node->data.size() : 0);
+    }
+
+    bool makeDirectory(const std::string& path, unsigned int mode) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        if (resolve(path)) {
+            errno = EEXIST;
+            return false;
+        }
+        std::string name;
+        std::shared_ptr<Node> parent = resolveParent(path, name);
+        if (!parent) {
+            return false;
+        }
+        if (parent->children.count(name) > 0) {
+            errno = EEXIST;
+            return false;
+        }
+
+        auto node = std::make_shared<Node>();
+        node->info.type = FileInfo::Type::Directory;
+        node->info.mode = mode;
+        node->info.inode = nextInode++;
+        node->info.owner = getuid();
+        touch(*node);
+        parent->children[name] = node;
+        return true;
+    }
+
+    bool rename(const std::string& from, const std::string& to) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::string fromName;
+        std::string toName;
+        std::shared_ptr<Node> fromParent = resolveParent(from, fromName);
+        std::shared_ptr<Node> toParent = resolveParent(to, toName);
+        if (!fromParent || !toParent) {
+            return false;
+        }
+
+        auto source = fromParent->children.find(fromName);
+        if (source == fromParent->children.end()) {
+            errno = ENOENT;
+            return false;
+        }
+        std::shared_ptr<Node> node = source->second;
+
+        // A directory cannot be moved below itself
+        if (node->info.type == FileInfo::Type::Directory &&
+            (absolutePath(to) + "/").rfind(absolutePath(from) + "/", 0) == 0) {
+            errno = EINVAL;
+            return false;
+        }
+
+        auto target = toParent->children.find(toName);
+        if (target != toParent->children.end()) {
+            if (target->second == node) {
+                return true;
+            }
+            bool targetIsDirectory = target->second->info.type == FileInfo::Type::Directory;
+            bool sourceIsDirectory = node->info.type == FileInfo::Type::Directory;
+            if (targetIsDirectory != sourceIsDirectory) {
+                errno = targetIsDirectory ? EISDIR : ENOTDIR;
+                return false;
+            }
+            if (targetIsDirectory && !target->second->children.empty()) {
+                errno = ENOTEMPTY;
+                return false;
+            }
+            target->second->info.linkCount--;
+        }
+
+        fromParent->children.erase(source);
+        toParent->children[toName] = node;
+        return true;
+    }
+
+    bool remove(const std::string& path) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::string name;
+        std::shared_ptr<Node> parent = resolveParent(path, name);
+        if (!parent) {
+            return false;
+        }
+
+        auto entry = parent->children.find(name);
+        if (entry == parent->children.end()) {
+            errno = ENOENT;
+            return false;
+        }
+        if (entry->second->info.type == FileInfo::Type::Directory && !entry->second->children.empty()) {
+            errno = ENOTEMPTY;
+            return false;
+        }
+        entry->second->info.linkCount--;
+        parent->children.erase(entry);
+        return true;
+    }
+
+    bool link(const std::string& target, const std::string& path) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        std::shared_ptr<Node> node = resolve(target);
+        std::string name;
+        std::shared_ptr<Node> parent = resolveParent(path, name);
+        if (!node || !parent) {
+            return false;
+        }
+        if (node->info.type == FileInfo::Type::Directory) {
+            errno = EPERM;
+            return false;
+        }
+        if (parent->children.count(name) > 0) {
+            errno = EEXIST;
+            return false;
+        }
+
+        node->info.linkCount++;
+        parent->children[name] = node;
+        return true;
+    }
+
+    bool syncDirectory(const std::string& path) override {
+        simulateLatency();
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return resolveDirectory(path) != nullptr;
+    }
+
+    bool changeDirectory(const std::string& path) override {
+        simulateLatency();
+        std::unique_lock<std::shared_mutex> lock(treeMutex);
+        if (!resolveDirectory(path)) {
+            return false;
+        }
+        workingDirectory = absolutePath(path);
+        return true;
+    }
+
+    std::string currentDirectory() override {
+        std::shared_lock<std::shared_mutex> lock(treeMutex);
+        return workingDirectory;
+    }
+
+private:
+    // A file or directory; hard links share one node
+    struct Node {
+        FileInfo info;
+        std::string data;
+        std::map<std::string, std::shared_ptr<Node>> children;
+    };
+
+    // File opened through MemoryFileSystem; data is read and written under the tree lock
+    class MemoryFileHandle : public FileHandle {
+    public:
+        MemoryFileHandle(MemoryFileSystem& owner, std::shared_ptr<Node> node, size_t position)
+            : owner(owner), node(std::move(node)), position(position) {}
+
+        ssize_t read(char* buffer, size_t length) override {
+            owner.simulateLatency();
+            std::shared_lock<std::shared_mutex> lock(owner.treeMutex);
+            size_t available = position < node->data.size() ? node->data.size() - position : 0;
+            size_t count = min(length, available);
+            memcpy(buffer, node->data.data() + position, count);
+            position += count;
+            return count;
+        }
+
+        ssize_t write(const char* buffer, size_t length) override {
+            owner.simulateLatency();
+            std::unique_lock<std::shared_mutex> lock(owner.treeMutex);
+            if (node->data.size() < position + length) {
+                node->data.resize(position + length);
+            }
+            memcpy(&node->data[position], buffer, length);
+            position += length;
+            owner.touch(*node);
+            return length;
+        }
+
+        bool sync() override {
+            return true;
+        }
+
+        bool close() override {
+            return true;
+        }
+
+    private:
+        MemoryFileSystem& owner;
+        std::shared_ptr<Node> node;
+        size_t position;
+    };
+
+    std::chrono::microseconds latency;
+    std::shared_mutex treeMutex;
+    std::shared_ptr<Node> root;
+    std::string workingDirectory = "/";
+    unsigned long long nextInode = 1;
+
+    void simulateLatency() const {
+        if (latency.count() > 0) {
+            std::this_thread::sleep_for(latency);
+        }
+    }
+
+    static void touch(Node& node) {
+        auto now = std::chrono::system_clock::now().time_since_epoch();
+        node.info.mtimeSeconds = std::chrono::duration_cast<std::chrono::seconds>(now).count();
+        node.info.mtimeNanoseconds = std::chrono::duration_cast<std::chrono::nanoseconds>(now).count() % 1000000000;
+    }
+
+    // Function to turn a path into an absolute, normalised one against the working directory
+    std::string absolutePath(const std::string& path) const {
+        fs::path absolute = (fs::path(workingDirectory) / path).lexically_normal();
+        std::string result = absolute.string();
+        while (result.size() > 1 && result.back() == '/') {
+            result.pop_back();
+        }
+        return result;
+    }
+
+    // Function to find a node, or set errno and return null; the caller holds the lock
+    std::shared_ptr<Node> resolve(const std::string& path) const {
+        std::shared_ptr<Node> node = root;
+        for (const auto& component : fs::path(absolutePath(path)).relative_path()) {
+            if (node->info.type != FileInfo::Type::Directory) {
+                errno = ENOTDIR;
+                return nullptr;
+            }
+            auto child = node->children.find(component.string());
+            if (child == node->children.end()) {
+                errno = ENOENT;
+                return nullptr;
+            }
+            node = child->second;
+        }
+        return node;
+    }
+
+    std::shared_ptr<Node> resolveDirectory(const std::string& path) const {
+        std::shared_ptr<Node> node = resolve(path);
+        if (node && node->info.type != FileInfo::Type::Directory) {
+            errno = ENOTDIR;
+            return nullptr;
+        }
+        return node;
+    }
+
+    // Function to find the directory that holds path and the name path has in it
+    std::shared_ptr<Node> resolveParent(const std::string& path, std::string& name) const {
+        fs::path absolute(absolutePath(path));
+        if (!absolute.has_relative_path()) {
+            errno = EBUSY;
+            return nullptr;
+        }
+        name = absolute.filename().string();
+        return resolveDirectory(absolute.parent_path().string());
+    }
+};
+
+// Function to append an integer in little-endian byte order, as used by ls --format=binary and pack
+template <typename Integer>
+static void appendLittleEndian(std::string& buffer, Integer value, int bytes) {
+    for (int i = 0; i < bytes; ++i) {
+        buffer.push_back(static_cast<char>((static_cast<unsigned long long>(value) >> (8 * i)) & 0xff));
+    }
+}
+
+// Function to decode a little-endian integer written by appendLittleEndian
+static unsigned long long readLittleEndian(const unsigned char* bytes, int count) {
+    unsigned long long value = 0;
+    for (int i = count - 1; i >= 0; --i) {
+        value = (value << 8) | bytes[i];
+    }
+    return value;
+}
+
+// Serialises batches of machine-readable ls records from all traversal threads onto one file descriptor
+class RecordSink {
+public:
+    // Records are batched per directory up to this size before being written
+    static const size_t BATCH_SIZE = 256 * 1024;
+
+    RecordSink(JobContext& context, int fd) : context(context), fd(fd) {}
+
+    // Function to write a batch of complete records and empty it for reuse
+    void append(std::string& batch) {
+        if (batch.empty()) {
+            return;
+        }
+
+        std::lock_guard<std::mutex> lock(sinkMutex);
+        size_t offset = 0;
+        while (offset < batch.size()) {
+            ssize_t written = write(fd, batch.data() + offset, batch.size() - offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                context.fail("ls");
+                break;
+            }
+            offset += written;
+        }
+        batch.clear();
+    }
+
+private:
+    JobContext& context;
+    int fd;
+    std::mutex sinkMutex;
+};
+
 class LsCommand {
 public:
+    LsCommand(JobContext& context, FileSystem& fileSystem) : context(context), fileSystem(fileSystem) {}
+
+    void execute(const vector<string>& args) {
+        bool reverseOrder = false;
+        bool listSize = false;
+        bool sortBySize = false;
+        bool recursiveList = false;
+
+        // Parse command-line options
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-r") {
+                reverseOrder = true;
+            } else if (args[i] == "-s") {
+                listSize = true;
+            } else if (args[i] == "-S") {
+                sortBySize = true;
+            } else if (args[i] == "-R" || args[i] == "--recursive") {
+                recursiveList = true;
+            } else if (args[i] == "--format=text") {
+                outputFormat = OutputFormat::Text;
+            } else if (args[i] == "--format=ndjson") {
+                outputFormat = OutputFormat::Ndjson;
+            } else if (args[i] == "--format=binary") {
+                outputFormat = OutputFormat::Binary;
+            } else if (args[i].rfind("--format=", 0) == 0) {
+                cerr << "ls: unknown format '" << args[i].substr(9) << "'" << endl;
+                context.failed = true;
+                return;
+            } else if (args[i] == "--help") {
+                displayLsHelp();
+                return;
+            }
+        }
+
+        // Machine-readable formats are written unsorted, straight from the traversal
+        if (outputFormat != OutputFormat::Text) {
+            cout.flush();
+            RecordSink sink(context, STDOUT_FILENO);
+            std::string header;
+            if (outputFormat == OutputFormat::Binary) {
+                header = BINARY_MAGIC;
+                sink.append(header);
+            }
+            streamRecords("", recursiveList, sink);
+            return;
+        }
+
+        // Open and read the directory recursively if the option is enabled
+        if (recursiveList) {
+            listFilesRecursively(".", reverseOrder, listSize, sortBySize);
+        } else {
+            listFiles(".", reverseOrder, listSize, sortBySize);
+        }
+    }
+
+private:
+    enum class OutputFormat { Text, Ndjson, Binary };
+
+    // Binary output starts with this magic, followed by length-prefixed records
+    static constexpr const char* BINARY_MAGIC = "LSB1";
+    static const size_t BINARY_FIXED_SIZE = 1 + 8 + 8 + 8 + 4;
+
+    JobContext& context;
+    FileSystem& fileSystem;
+    OutputFormat outputFormat = OutputFormat::Text;
+
+    // Function to display help information for ls command
+    void displayLsHelp() {
+        cout << "ls: List directory contents" << endl;
+        cout << "Usage: ls [options]" << endl;
+        cout << "Options:" << endl;
+        cout << "  -r\tList in reverse order" << endl;
+        cout << "  -s\tList file size" << endl;
+        cout << "  -S\tSort by file size" << endl;
+        cout << "  -R, --recursive\tList subdirectories recursively" << endl;
+        cout << "  --format=ndjson\tWrite one JSON object per entry with path, type, size, mtime and inode" << endl;
+        cout << "  --format=binary\tWrite the same fields as length-prefixed binary records" << endl;
+        cout << "  --help\tDisplay help information" << endl;
+    }
+
+    // Function to append an integer to a record without going through a stream
+    template <typename Integer>
+    static void appendNumber(std::string& batch, Integer value) {
+        char digits[24];
+        auto result = std::to_chars(digits, digits + sizeof(digits), value);
+        batch.append(digits, result.ptr);
+    }
+
+    // Function to return the length of the valid UTF-8 sequence starting at text[i], or 0 if there is none
+    static size_t utf8SequenceLength(const std::string& text, size_t i) {
+        unsigned char c = text[i];
+        if (c < 0x80) {
+            return 1;
+        }
+
+        size_t length;
+        unsigned int codePoint;
+        if ((c & 0xe0) == 0xc0) {
+            length = 2;
+            codePoint = c & 0x1f;
+        } else if ((c & 0xf0) == 0xe0) {
+            length = 3;
+            codePoint = c & 0x0f;
+        } else if ((c & 0xf8) == 0xf0) {
+            length = 4;
+            codePoint = c & 0x07;
+        } else {
+            return 0;
+        }
+        if (i + length > text.size()) {
+            return 0;
+        }
+        for (size_t k = 1; k < length; ++k) {
+            unsigned char next = text[i + k];
+            if ((next & 0xc0) != 0x80) {
+                return 0;
+            }
+            codePoint = (codePoint << 6) | (next & 0x3f);
+        }
+
+        // Overlong forms, UTF-16 surrogates and values past U+10FFFF are not valid UTF-8
+        static const unsigned int minimum[] = {0, 0, 0x80, 0x800, 0x10000};
+        if (codePoint < minimum[length] || (codePoint >= 0xd800 && codePoint <= 0xdfff) || codePoint > 0x10ffff) {
+            return 0;
+        }
+        return length;
+    }
+
+    // Function to append the standard base64 encoding of bytes
+    static void appendBase64(std::string& batch, const std::string& bytes) {
+        const char* alphabet = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+        size_t i = 0;
+        for (; i + 3 <= bytes.size(); i += 3) {
+            unsigned int group = (static_cast<unsigned char>(bytes[i]) << 16) |
+                                 (static_cast<unsigned char>(bytes[i + 1]) << 8) | static_cast<unsigned char>(bytes[i + 2]);
+            batch.push_back(alphabet[(group >> 18) & 0x3f]);
+            batch.push_back(alphabet[(group >> 12) & 0x3f]);
+            batch.push_back(alphabet[(group >> 6) & 0x3f]);
+            batch.push_back(alphabet[group & 0x3f]);
+        }
+        if (i < bytes.size()) {
+            unsigned int group = static_cast<unsigned char>(bytes[i]) << 16;
+            if (i + 1 < bytes.size()) {
+                group |= static_cast<unsigned char>(bytes[i + 1]) << 8;
+            }
+            batch.push_back(alphabet[(group >> 18) & 0x3f]);
+            batch.push_back(alphabet[(group >> 12) & 0x3f]);
+            batch.push_back(i + 1 < bytes.size() ? alphabet[(group >> 6) & 0x3f] : '=');
+            batch.push_back('=');
+        }
+    }
+
+    // Function to append one entry in the selected machine-readable format
+    void appendRecord(std::string& batch, const std::string& path, const FileInfo& info) {
+        const char* type = info.type == FileInfo::Type::Regular     ? "file"
+                           : info.type == FileInfo::Type::Directory ? "dir"
+                           : info.type == FileInfo::Type::Symlink   ? "symlink"
+                                                                    : "other";
+
+        if (outputFormat == OutputFormat::Binary) {
+            // [u32 length][u8 type][u64 inode][u64 size][i64 mtime_sec][u32 mtime_nsec][path], length excludes itself
+            appendLittleEndian(batch, BINARY_FIXED_SIZE + path.size(), 4);
+            batch.push_back(type[0]);
+            appendLittleEndian(batch, info.inode, 8);
+            appendLittleEndian(batch, info.size, 8);
+            appendLittleEndian(batch, info.mtimeSeconds, 8);
+            appendLittleEndian(batch, info.mtimeNanoseconds, 4);
+            batch += path;
+            return;
+        }
+
+        // Bytes that are not UTF-8 cannot appear in JSON; they become U+FFFD and path_b64 carries the exact name
+        batch += "{\"path\":\"";
+        bool lossy = false;
+        for (size_t i = 0; i < path.size();) {
+            unsigned char c = path[i];
+            size_t length = utf8SequenceLength(path, i);
+            if (length == 0) {
+                batch += "\\ufffd";
+                lossy = true;
+            } else if (length > 1) {
+                batch.append(path, i, length);
+                i += length;
+                continue;
+            } else if (c == '"' || c == '\\') {
+                batch.push_back('\\');
+                batch.push_back(c);
+            } else if (c < 0x20) {
+                const char* hex = "0123456789abcdef";
+                batch += "\\u00";
+                batch.push_back(hex[c >> 4]);
+                batch.push_back(hex[c & 0xf]);
+            } else {
+                batch.push_back(c);
+            }
+            ++i;
+        }
+        batch += "\"";
+        if (lossy) {
+            batch += ",\"path_b64\":\"";
+            appendBase64(batch, path);
+            batch += "\"";
+        }
+        batch += ",\"type\":\"";
+        batch += type;
+        batch += "\",\"size\":";
+        appendNumber(batch, info.size);
+        batch += ",\"mtime\":";
+        appendNumber(batch, info.mtimeSeconds);
+        batch += ",\"mtime_nsec\":";
+        appendNumber(batch, info.mtimeNanoseconds);
+        batch += ",\"inode\":";
+        appendNumber(batch, info.inode);
+        batch += "}\n";
+    }
+
+    // Function to stream records for a directory, and its subdirectories on their own threads if recursive
+    void streamRecords(const std::string& relativePath, bool recursive, RecordSink& sink) {
+        vector<DirectoryEntry> entries;
+        if (!fileSystem.listDirectory(relativePath.empty() ? "." : relativePath, entries, true)) {
+            context.fail("ls");
+            return;
+        }
+
+        std::string batch;
+        batch.reserve(RecordSink::BATCH_SIZE + 4096);
+        TaskGroup tasks;
+        for (const DirectoryEntry& entry : entries) {
+            if (context.stopped()) {
+                break;
+            }
+
+            std::string path = relativePath.empty() ? entry.name : relativePath + "/" + entry.name;
+            appendRecord(batch, path, entry.info);
+            context.filesDone++;
+            if (batch.size() >= RecordSink::BATCH_SIZE) {
+                sink.append(batch);
+            }
+
+            if (recursive && entry.info.type == FileInfo::Type::Directory) {
+                tasks.run([this, path, &sink]() {
+                    streamRecords(path, true, sink);
+                });
+            }
+        }
+        sink.append(batch);
+
+        // Wait for all tasks
+        tasks.wait();
+    }
+
+    // Function to list files in a directory
+    void listFiles(const std::string& directory, bool reverseOrder, bool listSize, bool sortBySize) {
+        vector<DirectoryEntry> entries;
+        vector<string> files{".", ".."};
+
+        if (fileSystem.listDirectory(directory, entries, false)) {
+            for (const DirectoryEntry& entry : entries) {
+                files.push_back(entry.name);
+            }
+
+            if (reverseOrder) {
+                reverse(files.begin(), files.end());
+            }
+
+            if (sortBySize) {
+                sort(files.begin(), files.end(), [this, directory](const string& a, const string& b) {
+                    FileInfo infoA, infoB;
+                    fileSystem.stat(directory + "/" + a, infoA);
+                    fileSystem.stat(directory + "/" + b, infoB);
+                    return infoA.size > infoB.size;
+                });
+            }
+
+            TaskGroup tasks;
+            for (const string& file : files) {
+                if (context.stopped()) {
+                    break;
+                }
+                tasks.run([this, &directory, &file, listSize]() {
+                    context.filesDone++;
+                    if (listSize) {
+                        FileInfo info;
+                        fileSystem.stat(directory + "/" + file, info);
+                        cout << info.size << "\t";
+                    }
+                    cout << file << endl;
+                });
+            }
+
+            tasks.wait();
+        } else {
+            context.fail("ls");
+        }
+    }
+
+    // Function to list files recursively
+    void listFilesRecursively(const std::string& directory, bool reverseOrder, bool listSize, bool sortBySize) {
+        listFiles(directory, reverseOrder, listSize, sortBySize);
+
+        // Each subdirectory is listed as a task of its own
+        TaskGroup tasks;
+
+        // Iterate over each file in the directory and list subdirectories recursively
+        vector<DirectoryEntry> entries;
+        fileSystem.listDirectory(directory, entries, false);
+        for (const DirectoryEntry& entry : entries) {
+            if (context.stopped()) {
+                break;
+            }
+            if (entry.info.type == FileInfo::Type::Directory) {
+                tasks.run([this, &directory, &entry, reverseOrder, listSize, sortBySize]() {
+                    cout << "Subdirectory: " << fs::path(entry.name) << endl;
+                    listFilesRecursively(directory + "/" + entry.name, reverseOrder, listSize, sortBySize);
+                });
+            }
+        }
+
+        // Wait for all tasks
+        tasks.wait();
+    }
+};
+
+class MvCommand {
+public:
+    MvCommand(JobContext& context, FileSystem& fileSystem) : context(context), fileSystem(fileSystem) {}
+
+    void execute(const vector<string>& args) {
+        bool forceOverwrite = false;
+        bool interactivePrompt = false;
+        vector<string> operands;
+
+        // Parse command-line options
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-f") {
+                forceOverwrite = true;
+            } else if (args[i] == "-i") {
+                interactivePrompt = true;
+            } else if (args[i] == "--help") {
+                displayMvHelp();
+                return;
+            } else {
+                operands.push_back(args[i]);
+            }
+        }
+
+        // Check for the correct number of arguments
+        if (operands.size() < 2) {
+            cerr << "mv: missing source or destination file" << endl;
+            context.failed = true;
+            return;
+        }
+
+        const string& source = operands[0];
+        const string& destination = operands[1];
+
+        // Check if the destination file exists and if interactive prompt is enabled
+        if (interactivePrompt && fileSystem.exists(destination)) {
+            char response;
+            cout << "mv: overwrite '" << destination << "'? (y/n): ";
+            cin >> response;
+
+            if (response != 'y') {
+                return;
+            }
+        }
+
+        // Perform the move operation
+        if (!fileSystem.rename(source, destination)) {
+            if (forceOverwrite) {
+                // If force overwrite is enabled, remove the destination file and try again
+                fileSystem.remove(destination);
+                if (!fileSystem.rename(source, destination)) {
+                    context.fail("mv");
+                }
+            } else {
+                context.fail("mv");
+            }
+        }
+    }
+
+private:
+    JobContext& context;
+    FileSystem& fileSystem;
+
+    // Function to display help information for mv command
+    void displayMvHelp() {
+        cout << "mv: Move or rename files" << endl;
+        cout << "Usage: mv [options] <source> <destination>" << endl;
+        cout << "Options:" << endl;
+        cout << "  -f\tForce move by overwriting destination file without prompt" << endl;
+        cout << "  -i\tInteractive prompt before overwrite" << endl;
+        cout << "  --help\tDisplay help information" << endl;
+    }
+};
+
+// ioprio_set(2) has no glibc wrapper, so its constants are defined here
+const int IOPRIO_CLASS_SHIFT = 13;
+const int IOPRIO_CLASS_RT = 1;
+const int IOPRIO_CLASS_BE = 2;
+const int IOPRIO_CLASS_IDLE = 3;
+const int IOPRIO_WHO_PROCESS = 1;
+
+// Function to set the I/O scheduling class of the calling thread
+static bool setThreadIoPriority(int ioClass, int level) {
+    return syscall(SYS_ioprio_set, IOPRIO_WHO_PROCESS, 0, (ioClass << IOPRIO_CLASS_SHIFT) | level) == 0;
+}
+
+// Function to set the nice value of the calling thread
+static bool setThreadNice(int niceValue) {
+    return setpriority(PRIO_PROCESS, static_cast<id_t>(syscall(SYS_gettid)), niceValue) == 0;
+}
+
+// Token bucket shared by all worker threads of a command; a rate of 0 means unlimited
+class TokenBucket {
+public:
+    explicit TokenBucket(double rate = 0) {
+        setRate(rate);
+    }
+
+    void setRate(double newRate) {
+        rate = newRate;
+        // A quarter second of burst smooths out scheduling jitter without letting a backlog build up
+        capacity = rate / 4;
+        tokens = capacity;
+        lastRefill = std::chrono::steady_clock::now();
+    }
+
+    bool limited() const {
+        return rate > 0;
+    }
+
+    // Function to take tokens, sleeping while the bucket is in debt; returns false if the job was stopped
+    bool acquire(double amount, JobContext& context) {
+        if (!limited()) {
+            return !context.stopped();
+        }
+
+        double waitSeconds;
+        {
+            std::lock_guard<std::mutex> lock(bucketMutex);
+            auto now = std::chrono::steady_clock::now();
+            tokens = min(capacity, tokens + rate * std::chrono::duration<double>(now - lastRefill).count());
+            lastRefill = now;
+
+            // Requests larger than the burst are allowed and paid back by the callers that follow
+            tokens -= amount;
+            waitSeconds = tokens < 0 ? -tokens / rate : 0;
+        }
+        if (waitSeconds <= 0) {
+            return !context.stopped();
+        }
+
+        throttleCount++;
+        auto waitStart = std::chrono::steady_clock::now();
+        auto deadline = waitStart + std::chrono::duration_cast<std::chrono::steady_clock::duration>(
+            std::chrono::duration<double>(waitSeconds));
+        while (!context.stopped() && std::chrono::steady_clock::now() < deadline) {
+            std::this_thread::sleep_for(min<std::chrono::steady_clock::duration>(
+                deadline - std::chrono::steady_clock::now(), std::chrono::milliseconds(100)));
+        }
+        auto waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+            std::chrono::steady_clock::now() - waitStart).count();
+        throttledNanoseconds += waited;
+        context.throttledNanoseconds += waited;
+        return !context.stopped();
+    }
+
+    unsigned long long throttles() const {
+        return throttleCount;
+    }
+
+    double throttledSeconds() const {
+        return throttledNanoseconds / 1e9;
+    }
+
+private:
+    double rate = 0;
+    double capacity = 0;
+    double tokens = 0;
+    std::chrono::steady_clock::time_point lastRefill;
+    std::mutex bucketMutex;
+    std::atomic<unsigned long long> throttleCount{0};
+    std::atomic<unsigned long long> throttledNanoseconds{0};
+};
+
+// Bandwidth and metadata limits plus scheduling priority given to cp and rm
+class IoThrottle {
+public:
+    TokenBucket bytes;
+    TokenBucket metadataOps;
+    bool invalid = false;
+
+    // Function to consume a --bwlimit, --ops-limit, --ioprio or --nice option; returns false for other arguments.
+    // Commands that move no data, like rm, pass withBandwidth as false and have --bwlimit rejected.
+    bool parseOption(const string& arg, const char* command, bool withBandwidth) {
+        string value = arg.substr(arg.find('=') + 1);
+        if (arg.rfind("--bwlimit=", 0) == 0) {
+            if (withBandwidth) {
+                bytes.setRate(parseRate(value, command));
+            } else {
+                cerr << command << ": --bwlimit is not supported, it moves no data" << endl;
+                invalid = true;
+            }
+        } else if (arg.rfind("--ops-limit=", 0) == 0) {
+            metadataOps.setRate(parseRate(value, command));
+        } else if (arg.rfind("--ioprio=", 0) == 0) {
+            parseIoPriority(value, command);
+        } else if (arg.rfind("--nice=", 0) == 0) {
+            char* end;
+            niceValue = strtol(value.c_str(), &end, 10);
+            niceRequested = true;
+            if (value.empty() || *end != '\0') {
+                cerr << command << ": invalid nice value '" << value << "'" << endl;
+                invalid = true;
+            }
+        } else {
+            return false;
+        }
+        return true;
+    }
+
+    // Function to print the option descriptions shared by cp and rm
+    static void displayHelp(bool withBandwidth) {
+        if (withBandwidth) {
+            cout << "  --bwlimit=RATE\tLimit data transfer to RATE bytes/s (K, M and G suffixes allowed)" << endl;
+        }
+        cout << "  --ops-limit=RATE\tLimit metadata operations (open, mkdir, rename, unlink) to RATE per second" << endl;
+        cout << "  --ioprio=CLASS[:LEVEL]\tRun with I/O scheduling class idle, be or rt (LEVEL 0-7)" << endl;
+        cout << "  --nice=N\tRun with nice value N" << endl;
+    }
+
+    // Function to run work on a thread carrying the requested priority, which its worker threads inherit
+    template <typename Work>
+    void run(Work work, const char* command) {
+        if (ioClass < 0 && !niceRequested) {
+            work();
+            return;
+        }
+
+        // The shell's own thread keeps its priority, since a raised nice value could not be undone
+        std::thread prioritized([&]() {
+            if (ioClass >= 0 && !setThreadIoPriority(ioClass, ioLevel)) {
+                perror(command);
+            }
+            if (niceRequested && !setThreadNice(niceValue)) {
+                perror(command);
+            }
+            work();
+        });
+        prioritized.join();
+    }
+
+    // Function to describe how long the limits held the command back; waits of parallel workers add up
+    string metrics(const char* command) const {
+        char line[256];
+        string report;
+        if (bytes.limited()) {
+            snprintf(line, sizeof(line), "%s: bandwidth throttled %llu times, %.2fs total wait across workers\n",
+                     command, bytes.throttles(), bytes.throttledSeconds());
+            report += line;
+        }
+        if (metadataOps.limited()) {
+            snprintf(line, sizeof(line), "%s: metadata operations throttled %llu times, %.2fs total wait across workers\n",
+                     command, metadataOps.throttles(), metadataOps.throttledSeconds());
+            report += line;
+        }
+        return report;
+    }
+
+private:
+    int ioClass = -1;
+    int ioLevel = 0;
+    bool niceRequested = false;
+    int niceValue = 0;
+
+    // Function to parse a rate such as 500, 64K or 10M
+    double parseRate(const string& value, const char* command) {
+        char* end;
+        double rate = strtod(value.c_str(), &end);
+        string suffix(end);
+        if (suffix == "K" || suffix == "k") {
+            rate *= 1024;
+        } else if (suffix == "M" || suffix == "m") {
+            rate *= 1024 * 1024;
+        } else if (suffix == "G" || suffix == "g") {
+            rate *= 1024.0 * 1024 * 1024;
+        } else if (!suffix.empty()) {
+            rate = -1;
+        }
+
+        if (value.empty() || end == value.c_str() || rate <= 0) {
+            cerr << command << ": invalid rate '" << value << "'" << endl;
+            invalid = true;
+            return 0;
+        }
+        return rate;
+    }
+
+    // Function to parse an I/O scheduling class with an optional level
+    void parseIoPriority(const string& value, const char* command) {
+        string className = value.substr(0, value.find(':'));
+        bool validLevel = true;
+        if (value.find(':') != string::npos) {
+            string level = value.substr(value.find(':') + 1);
+            char* end;
+            ioLevel = strtol(level.c_str(), &end, 10);
+            validLevel = !level.empty() && *end == '\0';
+        }
+
+        if (className == "idle") {
+            ioClass = IOPRIO_CLASS_IDLE;
+            ioLevel = 0;
+        } else if (className == "be" || className == "best-effort") {
+            ioClass = IOPRIO_CLASS_BE;
+        } else if (className == "rt" || className == "realtime") {
+            ioClass = IOPRIO_CLASS_RT;
+        }
+
+        if (ioClass < 0 || !validLevel || ioLevel < 0 || ioLevel > 7) {
+            cerr << command << ": invalid I/O priority '" << value << "'" << endl;
+            invalid = true;
+        }
+    }
+};
+
+// Deletes trashed trees on a low-priority background thread; see rm --trash
+class TrashPurger {
+public:
+    // Maximum unlink/rmdir calls per second so purging never competes with foreground work
+    static const int OPS_PER_SECOND = 2000;
+
+    // An empty registry path keeps no record of trash directories, for backends that do not outlive the shell
+    TrashPurger(FileSystem& fileSystem, const string& registryPath)
+        : fileSystem(fileSystem), registryPath(registryPath), opsLimit(OPS_PER_SECOND) {
+        loadRegistry();
+        worker = std::thread([this]() { purgeLoop(); });
+    }
+
+    ~TrashPurger() {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            context.stopRequested = true;
+        }
+        queueChanged.notify_one();
+        worker.join();
+    }
+
+    // Function to atomically move a path into its filesystem's trash and queue it for purging
+    bool moveToTrash(const string& path) {
+        // Trailing separators would otherwise make the target its own parent
+        string operand = path;
+        while (operand.size() > 1 && operand.back() == '/') {
+            operand.pop_back();
+        }
+        const string name = fs::path(operand).filename().string();
+        if (name.empty() || name == "." || name == "..") {
+            errno = EINVAL;
+            return false;
+        }
+
+        FileInfo parentInfo;
+        fs::path parent = (fs::path(fileSystem.currentDirectory()) / operand).lexically_normal().parent_path();
+        if (!fileSystem.stat(parent.string(), parentInfo)) {
+            return false;
+        }
+
+        // The trashed name only has to be unique, the purger never looks at it
+        string trashedName = to_string(getpid()) + "." + to_string(trashCounter++) + "." + name;
+
+        // One trash directory per user and filesystem: the home directory's, else one at the filesystem root
+        int error = EXDEV;
+        for (const string& trashDirectory : trashCandidates(parent, parentInfo.device)) {
+            if (!prepareTrashDirectory(trashDirectory, parentInfo.device)) {
+                error = errno;
+                continue;
+            }
+            if (fileSystem.rename(operand, trashDirectory + "/" + trashedName)) {
+                registerTrashDirectory(trashDirectory);
+                enqueue(trashDirectory, trashedName);
+                return true;
+            }
+            if (errno != EACCES && errno != EPERM && errno != EROFS && errno != EXDEV) {
+                return false;
+            }
+            error = errno;
+        }
+        errno = error;
+        return false;
+    }
+
+private:
+    FileSystem& fileSystem;
+    string registryPath;
+    std::unordered_set<string> trashDirectories;
+    std::mutex registryMutex;
+    std::atomic<unsigned long> trashCounter{0};
+
+    // Trashed entries waiting for the purger, as (trash directory, name inside it)
+    std::vector<pair<string, string>> pending;
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    JobContext context;
+    TokenBucket opsLimit;
+    std::thread worker;
+
+    // Function to list the trash directories that could hold an entry of the given directory, in order of preference
+    vector<string> trashCandidates(const fs::path& parent, unsigned long long device) {
+        vector<string> candidates;
+        const char* home = getenv("HOME");
+        FileInfo homeInfo;
+        if (home != nullptr && *home != '\0' && fileSystem.stat(home, homeInfo) && homeInfo.device == device) {
+            candidates.push_back((fs::path(home) / ".shell-trash").string());
+        }
+
+        // Walk up to the root of the filesystem so one trash directory serves the whole mount
+        fs::path mountRoot = parent;
+        FileInfo upInfo;
+        while (mountRoot.has_relative_path() && fileSystem.stat(mountRoot.parent_path().string(), upInfo) &&
+               upInfo.device == device) {
+            mountRoot = mountRoot.parent_path();
+        }
+        candidates.push_back((mountRoot / (".shell-trash-" + to_string(getuid()))).string());
+        return candidates;
+    }
+
+    // Function to create a trash directory, or accept an existing one only if it is a real directory on the
+    // expected filesystem that belongs to this user and nobody else can write to
+    bool prepareTrashDirectory(const string& trashDirectory, unsigned long long device) {
+        if (!fileSystem.makeDirectory(trashDirectory, 0700) && errno != EEXIST) {
+            return false;
+        }
+
+        FileInfo info;
+        if (!fileSystem.stat(trashDirectory, info, false)) {
+            return false;
+        }
+        if (info.type != FileInfo::Type::Directory || info.owner != getuid() || (info.mode & 022) != 0 ||
+            info.device != device) {
+            errno = EPERM;
+            return false;
+        }
+        return true;
+    }
+
+    // Function to queue leftovers from trash directories used by earlier shells
+    void loadRegistry() {
+        if (registryPath.empty()) {
+            return;
+        }
+
+        std::ifstream registry(registryPath);
+        string trashDirectory;
+        while (getline(registry, trashDirectory)) {
+            if (trashDirectory.empty() || !trashDirectories.insert(trashDirectory).second) {
+                continue;
+            }
+
+            // A directory that has changed hands since it was recorded is left alone
+            FileInfo info;
+            if (!fileSystem.stat(trashDirectory, info, false) ||
+                !prepareTrashDirectory(trashDirectory, info.device)) {
+                continue;
+            }
+            vector<DirectoryEntry> entries;
+            fileSystem.listDirectory(trashDirectory, entries, false);
+            for (const DirectoryEntry& entry : entries) {
+                pending.emplace_back(trashDirectory, entry.name);
+            }
+        }
+    }
+
+    // Function to remember a trash directory so a later shell purges what this one leaves behind
+    void registerTrashDirectory(const string& trashDirectory) {
+        std::lock_guard<std::mutex> lock(registryMutex);
+        if (trashDirectories.insert(trashDirectory).second && !registryPath.empty()) {
+            std::ofstream registry(registryPath, std::ios::app);
+            registry << trashDirectory << endl;
+        }
+    }
+
+    // Function to hand a trashed entry to the purger thread
+    void enqueue(const string& trashDirectory, const string& trashedName) {
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            pending.emplace_back(trashDirectory, trashedName);
+        }
+        queueChanged.notify_one();
+    }
+
+    // Function run by the purger thread until the shell exits
+    void purgeLoop() {
+        setThreadIoPriority(IOPRIO_CLASS_IDLE, 0);
+        setThreadNice(19);
+
+        while (true) {
+            pair<string, string> trashed;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this] { return context.stopped() || !pending.empty(); });
+                if (context.stopped()) {
+                    return;
+                }
+                trashed = pending.back();
+                pending.pop_back();
+            }
+
+            // Symbolic links are removed, never followed; an interrupted purge resumes at the next start
+            fileSystem.removeTree(trashed.first, trashed.second, [this]() {
+                return opsLimit.acquire(1, context);
+            });
+        }
+    }
+};
+
+class RmCommand {
+public:
+    RmCommand(JobContext& context, FileSystem& fileSystem, TrashPurger& purger)
+        : context(context), fileSystem(fileSystem), purger(purger) {}
+
+    void execute(const vector<string>& args) {
+        bool interactivePrompt = false;
+        bool recursiveRemove = false;
+        bool trashRemove = false;
+        vector<string> operands;
+
+        // Parse command-line options
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "-i") {
+                interactivePrompt = true;
+            } else if (args[i] == "--recursive") {
+                recursiveRemove = true;
+            } else if (args[i] == "--trash") {
+                trashRemove = true;
+            } else if (args[i] == "--help") {
+                displayRmHelp();
+                return;
+            } else if (throttle.parseOption(args[i], "rm", false)) {
+                continue;
+            } else {
+                operands.push_back(args[i]);
+            }
+        }
+
+        // Check for the correct number of arguments
+        if (operands.empty()) {
+            cerr << "rm: missing file operand" << endl;
+            context.failed = true;
+            return;
+        }
+        if (throttle.invalid) {
+            context.failed = true;
+            return;
+        }
+
+        const char* file = operands[0].c_str();
+
+        // Check if interactive prompt is enabled
+        if (interactivePrompt) {
+            char response;
+            cout << "rm: remove '" << file << "'? (y/n): ";
+            cin >> response;
+
+            if (response != 'y') {
+                return;
+            }
+        }
+
+        // Perform the remove operation
+        throttle.run([&]() {
+            if (trashRemove) {
+                FileInfo info;
+                if (!recursiveRemove && fileSystem.stat(file, info, false) && info.type == FileInfo::Type::Directory) {
+                    cerr << "rm: cannot remove '" << file << "': Is a directory" << endl;
+                    context.failed = true;
+                } else if (!purger.moveToTrash(file)) {
+                    cerr << "rm: cannot move '" << file << "' to the trash: " << strerror(errno) << endl;
+                    context.failed = true;
+                }
+            } else if (recursiveRemove) {
+                removeDirectory(file);
+            } else if (throttle.metadataOps.acquire(1, context) && !fileSystem.remove(file)) {
+                context.fail("rm");
+            }
+        }, "rm");
+        context.summary = throttle.metrics("rm");
+    }
+
+private:
+    JobContext& context;
+    FileSystem& fileSystem;
+    TrashPurger& purger;
+    IoThrottle throttle;
+
+    // Function to display help information for rm command
+    void displayRmHelp() {
+        cout << "rm: Remove files or directories" << endl;
+        cout << "Usage: rm [options] <file>" << endl;
+        cout << "Options:" << endl;
+        cout << "  -i\tPrompt before every removal" << endl;
+        cout << "  --recursive\tRemove directories and their contents recursively" << endl;
+        cout << "  --trash\tRename the target into the filesystem's trash and delete it in the background" << endl;
+        IoThrottle::displayHelp(false);
+        cout << "  --help\tDisplay help information" << endl;
+    }
+
+    // Function to remove a directory recursively
+    void removeDirectory(const std::string& path) {
+        TaskGroup tasks;
+
+        if (!throttle.metadataOps.acquire(1, context)) {
+            return;
+        }
+
+        // A path that is not a directory is simply removed below
+        vector<DirectoryEntry> entries;
+        if (!fileSystem.listDirectory(path, entries, false) && errno != ENOTDIR) {
+            context.fail("rm");
+            return;
+        }
+
+        // Iterate over each entry in the directory and remove it; symbolic links are removed, never followed
+        for (const DirectoryEntry& entry : entries) {
+            if (context.stopped()) {
+                break;
+            }
+            tasks.run([this, &path, &entry]() {
+                if (context.stopped()) {
+                    return;
+                }
+                const std::string currentPath = path + "/" + entry.name;
+                if (entry.info.type == FileInfo::Type::Directory) {
+                    removeDirectory(currentPath);
+                } else if (!throttle.metadataOps.acquire(1, context)) {
+                    return;
+                } else if (!fileSystem.remove(currentPath)) {
+                    context.fail("rm");
+                } else {
+                    context.filesDone++;
+                }
+            });
+        }
+
+        // Wait for all tasks
+        tasks.wait();
+
+        // A cancelled removal leaves the directory and whatever it still contains in place
+        if (!throttle.metadataOps.acquire(1, context)) {
+            return;
+        }
+
+        // Remove the main directory after its contents have been removed
+        if (!fileSystem.remove(path)) {
+            context.fail("rm");
+        }
+    }
+};
+
+// Append-only record of the entries a journaled copy has finished, used by cp --resume
+class CopyJournal {
+public:
+    CopyJournal(FileSystem& fileSystem, const std::string& path) : fileSystem(fileSystem), path(path) {}
+
+    // Function to load the entries finished by an earlier run and open the journal for appending
+    bool open(bool resume) {
+        if (resume) {
+            std::string contents;
+            std::unique_ptr<FileHandle> journalFile = fileSystem.open(path, FileSystem::OpenMode::Read);
+            if (journalFile) {
+                char buffer[65536];
+                ssize_t bytesRead;
+                while ((bytesRead = journalFile->read(buffer, sizeof(buffer))) > 0) {
+                    contents.append(buffer, bytesRead);
+                }
+            }
+
+            // One escaped relative path per line; a record only counts once its newline has been written
+            size_t start = 0;
+            size_t end;
+            while ((end = contents.find('\n', start)) != std::string::npos) {
+                completed.insert(unescape(contents.substr(start, end - start)));
+                start = end + 1;
+            }
+
+            // Drop a torn record left by a crash so the next append starts on a fresh line
+            if (start < contents.size() && !rewrite(contents.substr(0, start))) {
+                return false;
+            }
+        }
+
+        file = fileSystem.open(path, resume ? FileSystem::OpenMode::Append : FileSystem::OpenMode::Write);
+        return file != nullptr;
+    }
+
+    // Function to check whether an entry was finished by an earlier run
+    bool isComplete(const std::string& entry) const {
+        return completed.count(entry) > 0;
+    }
+
+    // Function to list every entry finished by an earlier run
+    const std::unordered_set<std::string>& completedEntries() const {
+        return completed;
+    }
+
+    // Function to note a finished entry of a destination directory; it is journaled once the directory is synced
+    void record(const std::string& directory, const std::string& entry) {
+        std::vector<std::string> ready;
+        {
+            std::lock_guard<std::mutex> lock(batchMutex);
+            std::vector<std::string>& batch = unsynced[directory];
+            batch.push_back(entry);
+            if (batch.size() < SYNC_BATCH) {
+                return;
+            }
+            ready.swap(batch);
+        }
+        commit(directory, ready);
+    }
+
+    // Function to journal what is still waiting for a directory, called once all its entries are done
+    void finishDirectory(const std::string& directory) {
+        std::vector<std::string> ready;
+        {
+            std::lock_guard<std::mutex> lock(batchMutex);
+            auto batch = unsynced.find(directory);
+            if (batch == unsynced.end()) {
+                return;
+            }
+            ready.swap(batch->second);
+            unsynced.erase(batch);
+        }
+        commit(directory, ready);
+    }
+
+    // Function to delete the journal once the copy has completed
+    void remove() {
+        file->close();
+        file.reset();
+        fileSystem.remove(path);
+    }
+
+private:
+    FileSystem& fileSystem;
+    std::string path;
+    std::unique_ptr<FileHandle> file;
+    std::unordered_set<std::string> completed;
+    std::mutex writeMutex;
+
+    // Entries are journaled per directory in batches of this size, each after one sync of the directory
+    static const size_t SYNC_BATCH = 256;
+    std::unordered_map<std::string, std::vector<std::string>> unsynced;
+    std::mutex batchMutex;
+
+    // Function to sync a directory, so the renames of its entries survive a crash, and only then journal them;
+    // a record never names a file whose rename could still be lost
+    void commit(const std::string& directory, const std::vector<std::string>& entries) {
+        if (entries.empty()) {
+            return;
+        }
+        if (!fileSystem.syncDirectory(directory)) {
+            perror("cp: journal");
+            return;
+        }
+
+        std::string lines;
+        for (const std::string& entry : entries) {
+            lines += escape(entry);
+            lines += '\n';
+        }
+        std::lock_guard<std::mutex> lock(writeMutex);
+        if (file->write(lines.data(), lines.size()) != static_cast<ssize_t>(lines.size())) {
+            perror("cp: journal");
+        }
+    }
+
+    // Function to keep a record on one line by escaping backslashes and newlines in the name
+    static std::string escape(const std::string& entry) {
+        std::string escaped;
+        escaped.reserve(entry.size());
+        for (char c : entry) {
+            if (c == '\\') {
+                escaped += "\\\\";
+            } else if (c == '\n') {
+                escaped += "\\n";
+            } else {
+                escaped.push_back(c);
+            }
+        }
+        return escaped;
+    }
+
+    // Function to decode a record written by escape
+    static std::string unescape(const std::string& line) {
+        std::string entry;
+        entry.reserve(line.size());
+        for (size_t i = 0; i < line.size(); ++i) {
+            if (line[i] == '\\' && i + 1 < line.size()) {
+                entry.push_back(line[++i] == 'n' ? '\n' : line[i]);
+            } else {
+                entry.push_back(line[i]);
+            }
+        }
+        return entry;
+    }
+
+    // Function to replace the journal with the given records through a temporary file
+    bool rewrite(const std::string& records) {
+        const std::string tempPath = path + ".tmp";
+        std::unique_ptr<FileHandle> tempFile = fileSystem.open(tempPath, FileSystem::OpenMode::Write);
+        if (!tempFile || tempFile->write(records.data(), records.size()) != static_cast<ssize_t>(records.size()) ||
+            !tempFile->sync() || !tempFile->close()) {
+            return false;
+        }
+        return fileSystem.rename(tempPath, path);
+    }
+};
+
+// Destinations of multiply-linked source files, keyed by (device, inode), shared by all copy workers
+class HardlinkMap {
+public:
+    // First copy of an inode; later links to it wait here until the copy is in place
+    struct Record {
+        std::mutex recordMutex;
+        std::condition_variable published;
+        bool done = false;
+        bool copied = false;
+        std::string destination;
+    };
+
+    // Function to look up an inode, registering destination as its copy if it is new; owner tells the caller to copy it
+    std::shared_ptr<Record> claim(unsigned long long device, unsigned long long inode, const std::string& destination,
+                                  bool& owner) {
+        InodeKey key{device, inode};
+        Shard& shard = shards[InodeKeyHash()(key) % SHARD_COUNT];
+
+        std::lock_guard<std::mutex> lock(shard.shardMutex);
+        auto inserted = shard.records.emplace(key, nullptr);
+        owner = inserted.second;
+        if (owner) {
+            inserted.first->second = std::make_shared<Record>();
+            inserted.first->second->destination = destination;
+        }
+        return inserted.first->second;
+    }
+
+    // Function to register an existing copy of an inode, made by an earlier run, as the target of its other names
+    void seed(unsigned long long device, unsigned long long inode, const std::string& destination) {
+        bool owner;
+        auto record = claim(device, inode, destination, owner);
+        if (owner) {
+            publish(*record, true);
+        }
+    }
+
+    // Function called by the owner once its copy has been renamed into place, or has failed
+    void publish(Record& record, bool copied) {
+        {
+            std::lock_guard<std::mutex> lock(record.recordMutex);
+            record.done = true;
+            record.copied = copied;
+        }
+        record.published.notify_all();
+    }
+
+    // Function to wait for the owner's copy; returns false if it failed and the caller should copy instead
+    bool waitFor(Record& record) {
+        std::unique_lock<std::mutex> lock(record.recordMutex);
+        record.published.wait(lock, [&record] { return record.done; });
+        return record.copied;
+    }
+
+private:
+    struct InodeKey {
+        unsigned long long device;
+        unsigned long long inode;
+
+        bool operator==(const InodeKey& other) const {
+            return device == other.device && inode == other.inode;
+        }
+    };
+
+    struct InodeKeyHash {
+        size_t operator()(const InodeKey& key) const {
+            return std::hash<unsigned long long>()(key.inode) ^ (std::hash<unsigned long long>()(key.device) << 1);
+        }
+    };
+
+    // Sharding keeps workers that meet unrelated inodes from contending on one lock
+    static const size_t SHARD_COUNT = 64;
+
+    struct Shard {
+        std::mutex shardMutex;
+        std::unordered_map<InodeKey, std::shared_ptr<Record>, InodeKeyHash> records;
+    };
+
+    Shard shards[SHARD_COUNT];
+};
+
+class CpCommand {
+public:
+    CpCommand(JobContext& context, FileSystem& fileSystem) : context(context), fileSystem(fileSystem) {}
+
+    void execute(const std::vector<std::string>& args) {
+        // Parse command-line options
+        bool recursiveCopy = false;
+        bool journaledCopy = false;
+        bool resumeCopy = false;
+        std::vector<std::string> operands;
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--help") {
+                displayCpHelp();
+                return;
+            } else if (args[i] == "-r" || args[i] == "--recursive") {
+                recursiveCopy = true;
+            } else if (args[i] == "--journal") {
+                journaledCopy = true;
+            } else if (args[i] == "--resume") {
+                journaledCopy = true;
+                resumeCopy = true;
+            } else if (throttle.parseOption(args[i], "cp", true)) {
+                continue;
+            } else {
+                operands.push_back(args[i]);
+            }
+        }
+
+        // Check for the correct number of arguments
+        if (operands.size() < 2) {
+            std::cerr << "cp: missing source or destination file" << std::endl;
+            context.failed = true;
+            return;
+        }
+        if (throttle.invalid) {
+            context.failed = true;
+            return;
+        }
+
+        const std::string& source = operands[0];
+        const std::string& destination = operands[1];
+
+        // Check if the source is a directory
+        throttle.run([&]() {
+            if (fileSystem.isDirectory(source)) {
+                if (journaledCopy) {
+                    copyDirectoryJournaled(source, destination, recursiveCopy, resumeCopy);
+                } else {
+                    copyDirectory(source, destination, recursiveCopy);
+                }
+            } else {
+                copyFile(source, destination, false);
+            }
+        }, "cp");
+        context.summary = throttle.metrics("cp");
+    }
+
+private:
+    JobContext& context;
+    FileSystem& fileSystem;
+    IoThrottle throttle;
+
+    // Journal of the running journaled copy, or null for a plain copy
+    CopyJournal* journal = nullptr;
+    std::string sourceRoot;
+    std::atomic<bool> copyFailed{false};
+    HardlinkMap hardlinks;
+
+    // Function to display help information for cp command
+    void displayCpHelp() {
+        std::cout << "cp: Copy files" << std::endl;
+        std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
+        std::cout << "Options:" << std::endl;
+        std::cout << "  -r, --recursive\tCopy directories recursively" << std::endl;
+        std::cout << "  --journal\tWrite each file under a temporary name and record finished files in <destination>.cp-journal" << std::endl;
+        std::cout << "  --resume\tContinue an interrupted journaled copy, skipping files it already finished" << std::endl;
+        IoThrottle::displayHelp(true);
+        std::cout << "  --help\tDisplay help information" << std::endl;
+    }
+
+    // Function to copy a file under a temporary name and rename it into place once it is complete
+    bool copyFile(const std::string& source, const std::string& destination, bool syncToDisk) {
+        const fs::path destPath(destination);
+        const std::string tempFile = destPath.parent_path() / ("." + destPath.filename().string() + ".cp-tmp");
+
+        // Opening the source, creating the temporary file and renaming it count as three metadata operations
+        if (!throttle.metadataOps.acquire(3, context)) {
+            return false;
+        }
+
+        // A failed or cancelled copy only ever leaves the temporary file behind, and removes it
+        if (!copyFileData(source, tempFile, syncToDisk)) {
+            fileSystem.remove(tempFile);
+            return false;
+        }
+        if (!fileSystem.rename(tempFile, destination)) {
+            context.fail("cp");
+            fileSystem.remove(tempFile);
+            return false;
+        }
+
+        context.filesDone++;
+        return true;
+    }
+
+    // Function to copy the contents of a file, optionally flushing the data to disk before returning
+    bool copyFileData(const std::string& source, const std::string& destination, bool syncToDisk) {
+        std::unique_ptr<FileHandle> sourceFile = fileSystem.open(source, FileSystem::OpenMode::Read);
+        if (!sourceFile) {
+            context.fail("cp");
+            return false;
+        }
+
+        std::unique_ptr<FileHandle> destFile = fileSystem.open(destination, FileSystem::OpenMode::Write);
+        if (!destFile) {
+            context.fail("cp");
+            return false;
+        }
+
+        bool ok = true;
+        std::vector<char> buffer(1 << 20);
+        ssize_t bytesRead;
+        while ((bytesRead = sourceFile->read(buffer.data(), buffer.size())) > 0) {
+            if (!throttle.bytes.acquire(bytesRead, context)) {
+                ok = false;
+                break;
+            }
+
+            ssize_t offset = 0;
+            while (offset < bytesRead) {
+                ssize_t bytesWritten = destFile->write(buffer.data() + offset, bytesRead - offset);
+                if (bytesWritten < 0) {
+                    break;
+                }
+                offset += bytesWritten;
+                context.bytesDone += bytesWritten;
+            }
+            if (offset < bytesRead) {
+                bytesRead = -1;
+                break;
+            }
+        }
+        if (ok && (bytesRead < 0 || (syncToDisk && !destFile->sync()))) {
+            context.fail("cp");
+            ok = false;
+        }
+
+        if (!destFile->close() && ok) {
+            context.fail("cp");
+            ok = false;
+        }
+        return ok;
+    }
+
+    // Function to hard link destination to an already copied file, replacing whatever is there
+    bool linkFile(const std::string& target, const std::string& destination) {
+        const fs::path destPath(destination);
+        const std::string tempFile = destPath.parent_path() / ("." + destPath.filename().string() + ".cp-tmp");
+
+        if (!throttle.metadataOps.acquire(2, context)) {
+            return false;
+        }
+        fileSystem.remove(tempFile);
+        if (!fileSystem.link(target, tempFile)) {
+            return false;
+        }
+
+        // rename() succeeds without removing the temporary name when both already name the same inode
+        bool linked = fileSystem.rename(tempFile, destination);
+        fileSystem.remove(tempFile);
+        if (linked) {
+            context.filesDone++;
+        }
+        return linked;
+    }
+
+    // Function to copy one file of a directory, recreating hard links and journaling it when enabled
+    void copyEntry(const std::string& source, const std::string& destination, const std::string& directory) {
+        std::string entry;
+        if (journal) {
+            entry = fs::path(source).lexically_relative(sourceRoot).string();
+        }
+        const bool alreadyCopied = journal && journal->isComplete(entry);
+
+        // Files with several names are copied once; the other names become links to that copy
+        FileInfo sourceInfo;
+        if (fileSystem.stat(source, sourceInfo) && sourceInfo.linkCount > 1) {
+            bool owner;
+            auto record = hardlinks.claim(sourceInfo.device, sourceInfo.inode, destination, owner);
+            if (owner) {
+                // A copy finished by an earlier run can serve as the link target straight away
+                bool copied = alreadyCopied || copyFile(source, destination, journal != nullptr);
+                hardlinks.publish(*record, copied);
+                if (!alreadyCopied) {
+                    finishEntry(directory, entry, copied);
+                }
+                return;
+            }
+            if (alreadyCopied) {
+                return;
+            }
+
+            // Fall back to a full copy if the first copy failed or the link crosses filesystems
+            if (hardlinks.waitFor(*record) && linkFile(record->destination, destination)) {
+                finishEntry(directory, entry, true);
+                return;
+            }
+        }
+
+        if (!alreadyCopied) {
+            // A journaled copy syncs the data before the rename so a crash never exposes a partial file
+            finishEntry(directory, entry, copyFile(source, destination, journal != nullptr));
+        }
+    }
+
+    // Function to record the outcome of a copied entry of a destination directory
+    void finishEntry(const std::string& directory, const std::string& entry, bool copied) {
+        if (!copied) {
+            copyFailed = true;
+        } else if (journal) {
+            journal->record(directory, entry);
+        }
+    }
+
+    // Function to copy a directory with a journal so an interrupted run can be resumed
+    void copyDirectoryJournaled(const std::string& source, const std::string& destination, bool recursive, bool resume) {
+        // The journal lives next to the destination so it is never copied or listed as part of the tree
+        fs::path destPath = fs::path(destination).lexically_normal();
+        if (!destPath.has_filename()) {
+            destPath = destPath.parent_path();
+        }
+        CopyJournal copyJournal(fileSystem, destPath.string() + ".cp-journal");
+        if (!copyJournal.open(resume)) {
+            context.fail("cp: journal");
+            return;
+        }
+
+        // Files finished by an earlier run become the link targets of their inodes before any worker claims one,
+        // so a resumed copy never makes a second copy of a file it already has
+        for (const std::string& entry : copyJournal.completedEntries()) {
+            FileInfo info;
+            if (fileSystem.stat(source + "/" + entry, info) && info.linkCount > 1) {
+                hardlinks.seed(info.device, info.inode, destination + "/" + entry);
+            }
+        }
+
+        journal = &copyJournal;
+        sourceRoot = source;
+        copyFailed = false;
+        copyDirectory(source, destination, recursive);
+        journal = nullptr;
+
+        if (copyFailed || context.stopped()) {
+            std::cerr << "cp: copy incomplete, rerun with --resume to continue" << std::endl;
+        } else {
+            copyJournal.remove();
+        }
+    }
+
+    // Function to copy a directory
+    void copyDirectory(const std::string& source, const std::string& destination, bool recursive) {
+        // Create the destination directory if it doesn't exist
+        if (!throttle.metadataOps.acquire(1, context)) {
+            return;
+        }
+        vector<DirectoryEntry> entries;
+        if (!fileSystem.makeDirectories(destination) || !fileSystem.listDirectory(source, entries, false)) {
+            context.fail("cp");
+            copyFailed = true;
+            return;
+        }
+
+        // A journaled copy makes the new directory itself durable before any of its entries is journaled
+        if (journal) {
+            std::string normalized = fs::path(destination).lexically_normal().string();
+            while (normalized.size() > 1 && normalized.back() == '/') {
+                normalized.pop_back();
+            }
+            fs::path parent = fs::path(normalized).parent_path();
+            if (!fileSystem.syncDirectory(parent.empty() ? "." : parent.string())) {
+                context.fail("cp");
+                copyFailed = true;
+                return;
+            }
+        }
+
+        TaskGroup tasks;
+
+        // Iterate over each file in the source directory and copy it to the destination
+        for (const DirectoryEntry& entry : entries) {
+            if (context.stopped()) {
+                break;
+            }
+            tasks.run([this, &source, &entry, &destination, recursive]() {
+                if (context.stopped()) {
+                    return;
+                }
+                const std::string sourceFile = source + "/" + entry.name;
+                const std::string destFile = destination + "/" + entry.name;
+
+                // Symbolic links to directories are copied as the directories they point to
+                bool isDirectory = entry.info.type == FileInfo::Type::Directory ||
+                                   (entry.info.type == FileInfo::Type::Symlink && fileSystem.isDirectory(sourceFile));
+
+                // Recursively copy directories if the option is enabled
+                if (isDirectory) {
+                    if (recursive) {
+                        copyDirectory(sourceFile, destFile, true);
+                    } else {
+                        std::cerr << "cp: -r not specified; omitting directory '" << sourceFile << "'" << std::endl;
+                        context.failed = true;
+                    }
+                } else {
+                    copyEntry(sourceFile, destFile, destination);
+                }
+            });
+        }
+
+        // Wait for all tasks
+        tasks.wait();
+        if (journal) {
+            journal->finishDirectory(destination);
+        }
+    }
+};
+
+// Layout shared by pack and unpack: the magic, then one header per entry, each file's data right after its header
+struct PackHeader {
+    static constexpr const char* MAGIC = "SPK1";
+    static constexpr char DIRECTORY = 'd';
+    static constexpr char REGULAR = 'f';
+    static constexpr char SYMLINK = 'l';
+    static constexpr char END = 'e';
+
+    // Files up to this size are read and written whole by worker threads; larger ones are streamed in order
+    static constexpr unsigned long long SMALL_FILE_LIMIT = 16ULL * 1024 * 1024;
+
+    // Bytes of small-file data allowed to wait between the workers and the archive
+    static constexpr unsigned long long PIPELINE_LIMIT = 256ULL * 1024 * 1024;
+
+    char type = END;
+    std::string path;
+    unsigned int mode = 0;
+    unsigned long long size = 0;
+
+    // Function to encode the header as [u8 type][u16 path length][path][u32 mode][u64 size]
+    std::string encode() const {
+        std::string header;
+        header.push_back(type);
+        if (type != END) {
+            appendLittleEndian(header, path.size(), 2);
+            header += path;
+            appendLittleEndian(header, mode, 4);
+            appendLittleEndian(header, size, 8);
+        }
+        return header;
+    }
+};
+
+// Function to pick the number of worker threads for pack and unpack
+static unsigned int packWorkerCount() {
+    unsigned int cores = std::thread::hardware_concurrency();
+    return cores == 0 ? 4 : min(cores, 16u);
+}
+
+// Buffered sequential writer for an archive
+class ArchiveWriter {
+public:
+    explicit ArchiveWriter(int fd) : fd(fd) {
+        buffer.reserve(BUFFER_SIZE);
+    }
+
+    void write(const char* data, size_t length) {
+        if (buffer.size() + length > BUFFER_SIZE) {
+            flush();
+        }
+        if (length >= BUFFER_SIZE) {
+            writeAll(data, length);
+        } else {
+            buffer.append(data, length);
+        }
+    }
+
+    void write(const std::string& data) {
+        write(data.data(), data.size());
+    }
+
+    // Function to write out buffered data; returns false if any write so far has failed
+    bool flush() {
+        writeAll(buffer.data(), buffer.size());
+        buffer.clear();
+        return !failed;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+    int fd;
+    std::string buffer;
+    bool failed = false;
+
+    void writeAll(const char* data, size_t length) {
+        while (length > 0 && !failed) {
+            ssize_t written = ::write(fd, data, length);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                perror("pack");
+                failed = true;
+                return;
+            }
+            data += written;
+            length -= written;
+        }
+    }
+};
+
+// Buffered sequential reader for an archive
+class ArchiveReader {
+public:
+    explicit ArchiveReader(int fd) : fd(fd), buffer(BUFFER_SIZE) {}
+
+    // Function to read exactly length bytes; returns false on a read error or a truncated archive
+    bool read(char* data, size_t length) {
+        while (length > 0) {
+            if (position == filled) {
+                ssize_t bytesRead = ::read(fd, buffer.data(), buffer.size());
+                if (bytesRead < 0 && errno == EINTR) {
+                    continue;
+                }
+                if (bytesRead <= 0) {
+                    return false;
+                }
+                position = 0;
+                filled = bytesRead;
+            }
+            size_t chunk = min(length, filled - position);
+            memcpy(data, buffer.data() + position, chunk);
+            position += chunk;
+            data += chunk;
+            length -= chunk;
+        }
+        return true;
+    }
+
+    // Function to read the next entry header
+    bool readHeader(PackHeader& header) {
+        if (!read(&header.type, 1)) {
+            return false;
+        }
+        if (header.type == PackHeader::END) {
+            return true;
+        }
+
+        unsigned char fields[12];
+        if (!read(reinterpret_cast<char*>(fields), 2)) {
+            return false;
+        }
+        header.path.resize(readLittleEndian(fields, 2));
+        if (!read(&header.path[0], header.path.size()) || !read(reinterpret_cast<char*>(fields), 12)) {
+            return false;
+        }
+        header.mode = readLittleEndian(fields, 4);
+        header.size = readLittleEndian(fields + 4, 8);
+        return true;
+    }
+
+private:
+    static const size_t BUFFER_SIZE = 4 * 1024 * 1024;
+
+    int fd;
+    std::vector<char> buffer;
+    size_t position = 0;
+    size_t filled = 0;
+};
+
+class PackCommand {
+public:
+    explicit PackCommand(JobContext& context) : context(context) {}
+
     void execute(const vector<string>& args) {
-        bool reverseOrder = false;
-        bool listSize = false;
-        bool sortBySize = false;
-        bool recursiveList = false;
+        vector<string> operands;
 
         // Parse command-line options
         for (size_t i = 1; i < args.size(); ++i) {
-            if (args[i] == "-r") {
-                reverseOrder = true;
-            } else if (args[i] == "-s") {
-                listSize = true;
-            } else if (args[i] == "-S") {
-                sortBySize = true;
-            } else if (args[i] == "-R" || args[i] == "--recursive") {
-                recursiveList = true;
-            } else if (args[i] == "--help") {
-                displayLsHelp();
+            if (args[i] == "--help") {
+                displayPackHelp();
                 return;
             }
+            operands.push_back(args[i]);
         }
 
-        // Open and read the directory recursively if the option is enabled
-        if (recursiveList) {
-            listFilesRecursively(".", reverseOrder, listSize, sortBySize);
-        } else {
-            listFiles(".", reverseOrder, listSize, sortBySize);
+        // Check for the correct number of arguments
+        if (operands.size() < 2) {
+            cerr << "pack: missing directory or archive" << endl;
+            context.failed = true;
+            return;
+        }
+
+        const string& source = operands[0];
+        const string& archive = operands[1];
+        if (!fs::is_directory(source)) {
+            cerr << "pack: '" << source << "' is not a directory" << endl;
+            context.failed = true;
+            return;
+        }
+
+        vector<PackHeader> entries;
+        if (!collectEntries(source, entries)) {
+            return;
+        }
+
+        // The archive only appears under its name once it is complete
+        const fs::path archivePath(archive);
+        const string tempArchive = archivePath.parent_path() / ("." + archivePath.filename().string() + ".pack-tmp");
+        int fd = open(tempArchive.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+        if (fd < 0) {
+            context.fail("pack");
+            return;
+        }
+
+        ArchiveWriter writer(fd);
+        bool ok = writeArchive(source, entries, writer) && writer.flush();
+        if (close(fd) != 0 && ok) {
+            context.fail("pack");
+            ok = false;
+        }
+        if (!ok || context.stopped() || rename(tempArchive.c_str(), archive.c_str()) != 0) {
+            if (ok && !context.stopped()) {
+                context.fail("pack");
+            } else if (!ok) {
+                context.failed = true;
+            }
+            unlink(tempArchive.c_str());
         }
     }
 
 private:
-    // Function to display help information for ls command
-    void displayLsHelp() {
-        cout << "ls: List directory contents" << endl;
-        cout << "Usage: ls [options]" << endl;
+    // Result of reading one small file on a worker thread
+    struct ReadResult {
+        bool ok = false;
+        std::vector<char> data;
+    };
+
+    JobContext& context;
+
+    // Hand-off between the reading workers and the in-order writer
+    std::mutex pipelineMutex;
+    std::condition_variable pipelineChanged;
+    std::unordered_map<size_t, ReadResult> readyFiles;
+    size_t nextToWrite = 0;
+    unsigned long long bufferedBytes = 0;
+
+    // Function to display help information for pack command
+    void displayPackHelp() {
+        cout << "pack: Pack a directory tree into a single archive" << endl;
+        cout << "Usage: pack <directory> <archive>" << endl;
         cout << "Options:" << endl;
-        cout << "  -r\tList in reverse order" << endl;
-        cout << "  -s\tList file size" << endl;
-        cout << "  -S\tSort by file size" << endl;
-        cout << "  -R, --recursive\tList subdirectories recursively" << endl;
         cout << "  --help\tDisplay help information" << endl;
     }
 
-    // Function to list files in a directory
-    void listFiles(const std::string& directory, bool reverseOrder, bool listSize, bool sortBySize) {
-        DIR* dir;
-        struct dirent* entry;
-        vector<string> files;
+    // Function to list the tree in pre-order so every directory precedes its contents
+    bool collectEntries(const string& source, vector<PackHeader>& entries) {
+        std::error_code error;
+        for (auto it = fs::recursive_directory_iterator(source, error); !error && it != fs::recursive_directory_iterator();
+             it.increment(error)) {
+            struct stat entryStat;
+            if (lstat(it->path().c_str(), &entryStat) != 0) {
+                context.fail("pack");
+                continue;
+            }
 
-        if ((dir = opendir(directory.c_str())) != NULL) {
-            while ((entry = readdir(dir)) != NULL) {
-                files.push_back(entry->d_name);
+            PackHeader header;
+            header.path = it->path().lexically_relative(source).string();
+            header.mode = entryStat.st_mode & 07777;
+            if (S_ISDIR(entryStat.st_mode)) {
+                header.type = PackHeader::DIRECTORY;
+            } else if (S_ISREG(entryStat.st_mode)) {
+                header.type = PackHeader::REGULAR;
+                header.size = entryStat.st_size;
+            } else if (S_ISLNK(entryStat.st_mode)) {
+                header.type = PackHeader::SYMLINK;
+            } else {
+                cerr << "pack: skipping special file '" << it->path().string() << "'" << endl;
+                continue;
             }
-            closedir(dir);
 
-            if (reverseOrder) {
-                reverse(files.begin(), files.end());
+            if (header.path.size() > 0xffff) {
+                cerr << "pack: path too long: '" << it->path().string() << "'" << endl;
+                context.failed = true;
+                continue;
             }
+            entries.push_back(header);
+        }
 
-            if (sortBySize) {
-                sort(files.begin(), files.end(), [directory](const string& a, const string& b) {
-                    struct stat fileStatA, fileStatB;
-                    string pathA = directory + "/" + a;
-                    string pathB = directory + "/" + b;
-                    stat(pathA.c_str(), &fileStatA);
-                    stat(pathB.c_str(), &fileStatB);
-                    return fileStatA.st_size > fileStatB.st_size;
-                });
+        if (error) {
+            cerr << "pack: " << error.message() << endl;
+            context.failed = true;
+            return false;
+        }
+        return true;
+    }
+
+    // Function run by each reader thread: read small files ahead of the writer, in claim order
+    void readFiles(const string& source, const vector<PackHeader>& entries, std::atomic<size_t>& nextToRead) {
+        while (!context.stopped()) {
+            size_t index = nextToRead++;
+            if (index >= entries.size()) {
+                return;
+            }
+            const PackHeader& entry = entries[index];
+            if (entry.type != PackHeader::REGULAR || entry.size > PackHeader::SMALL_FILE_LIMIT) {
+                continue;
             }
 
-            vector<thread> threads;
-            for (const string& file : files) {
-                threads.emplace_back([this, &directory, &file, listSize]() {
-                    if (listSize) {
-                        struct stat fileStat;
-                        string filePath = directory + "/" + file;
-                        stat(filePath.c_str(), &fileStat);
-                        cout << fileStat.st_size << "\t";
+            // The file the writer needs next is always read, so the memory limit can never stall the pipeline
+            {
+                std::unique_lock<std::mutex> lock(pipelineMutex);
+                while (index != nextToWrite && bufferedBytes + entry.size > PackHeader::PIPELINE_LIMIT &&
+                       !context.stopped()) {
+                    pipelineChanged.wait_for(lock, std::chrono::milliseconds(100));
+                }
+            }
+
+            ReadResult result;
+            result.ok = readWholeFile((fs::path(source) / entry.path).string(), entry.size, result.data);
+
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                bufferedBytes += result.data.size();
+                readyFiles[index] = std::move(result);
+            }
+            pipelineChanged.notify_all();
+        }
+    }
+
+    // Function to read a file of the expected size into memory
+    bool readWholeFile(const string& path, unsigned long long expectedSize, std::vector<char>& data) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            context.fail("pack");
+            return false;
+        }
+
+        // A file that changed since the tree was listed is stored as whatever is read now
+        data.resize(expectedSize);
+        size_t filled = 0;
+        ssize_t bytesRead = 0;
+        while (filled < data.size() && (bytesRead = read(fd, data.data() + filled, data.size() - filled)) > 0) {
+            filled += bytesRead;
+        }
+        data.resize(filled);
+        if (bytesRead < 0) {
+            context.fail("pack");
+        }
+        close(fd);
+        return bytesRead >= 0;
+    }
+
+    // Function to stream a large file straight into the archive, keeping the size announced in its header
+    bool streamLargeFile(const string& path, PackHeader header, ArchiveWriter& writer) {
+        int fd = open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            context.fail("pack");
+            return true;
+        }
+        struct stat fileStat;
+        if (fstat(fd, &fileStat) == 0) {
+            header.size = fileStat.st_size;
+        }
+        writer.write(header.encode());
+
+        std::vector<char> buffer(1 << 20);
+        unsigned long long remaining = header.size;
+        while (remaining > 0 && !context.stopped()) {
+            ssize_t bytesRead = read(fd, buffer.data(), min<unsigned long long>(buffer.size(), remaining));
+            if (bytesRead <= 0) {
+                // The header is already written, so a file that shrank is padded to its announced size
+                cerr << "pack: '" << path << "' changed while being packed" << endl;
+                std::fill(buffer.begin(), buffer.end(), 0);
+                while (remaining > 0) {
+                    size_t chunk = min<unsigned long long>(buffer.size(), remaining);
+                    writer.write(buffer.data(), chunk);
+                    remaining -= chunk;
+                }
+                break;
+            }
+            writer.write(buffer.data(), bytesRead);
+            remaining -= bytesRead;
+            context.bytesDone += bytesRead;
+        }
+        close(fd);
+        context.filesDone++;
+        return !context.stopped();
+    }
+
+    // Function to write entries in order while reader threads fetch small files ahead of the writer
+    bool writeArchive(const string& source, const vector<PackHeader>& entries, ArchiveWriter& writer) {
+        writer.write(PackHeader::MAGIC);
+
+        std::atomic<size_t> nextToRead{0};
+        vector<thread> threads;
+        for (unsigned int i = 0; i < packWorkerCount(); ++i) {
+            threads.emplace_back([this, &source, &entries, &nextToRead]() {
+                readFiles(source, entries, nextToRead);
+            });
+        }
+
+        for (size_t index = 0; index < entries.size() && !context.stopped(); ++index) {
+            const PackHeader& entry = entries[index];
+            const string path = (fs::path(source) / entry.path).string();
+
+            if (entry.type == PackHeader::DIRECTORY) {
+                writer.write(entry.encode());
+            } else if (entry.type == PackHeader::SYMLINK) {
+                std::error_code error;
+                string target = fs::read_symlink(path, error).string();
+                if (error) {
+                    cerr << "pack: " << path << ": " << error.message() << endl;
+                    context.failed = true;
+                } else {
+                    PackHeader header = entry;
+                    header.size = target.size();
+                    writer.write(header.encode());
+                    writer.write(target);
+                }
+            } else if (entry.size > PackHeader::SMALL_FILE_LIMIT) {
+                streamLargeFile(path, entry, writer);
+            } else {
+                ReadResult result;
+                {
+                    std::unique_lock<std::mutex> lock(pipelineMutex);
+                    while (readyFiles.count(index) == 0 && !context.stopped()) {
+                        pipelineChanged.wait_for(lock, std::chrono::milliseconds(100));
                     }
-                    cout << file << endl;
-                });
+                    if (context.stopped()) {
+                        break;
+                    }
+                    result = std::move(readyFiles[index]);
+                    readyFiles.erase(index);
+                    bufferedBytes -= result.data.size();
+                }
+
+                if (result.ok) {
+                    PackHeader header = entry;
+                    header.size = result.data.size();
+                    writer.write(header.encode());
+                    writer.write(result.data.data(), result.data.size());
+                    context.bytesDone += result.data.size();
+                    context.filesDone++;
+                }
             }
 
-            for (auto& thread : threads) {
-                thread.join();
+            {
+                std::lock_guard<std::mutex> lock(pipelineMutex);
+                nextToWrite = index + 1;
+            }
+            pipelineChanged.notify_all();
+        }
+
+        // Join all threads
+        for (auto& thread : threads) {
+            thread.join();
+        }
+
+        if (context.stopped()) {
+            return false;
+        }
+        PackHeader end;
+        writer.write(end.encode());
+        return true;
+    }
+};
+
+class UnpackCommand {
+public:
+    explicit UnpackCommand(JobContext& context) : context(context) {}
+
+    void execute(const vector<string>& args) {
+        vector<string> operands;
+
+        // Parse command-line options
+        for (size_t i = 1; i < args.size(); ++i) {
+            if (args[i] == "--help") {
+                displayUnpackHelp();
+                return;
+            }
+            operands.push_back(args[i]);
+        }
+
+        // Check for the correct number of arguments
+        if (operands.size() < 2) {
+            cerr << "unpack: missing archive or directory" << endl;
+            context.failed = true;
+            return;
+        }
+
+        const string& archive = operands[0];
+        const string& destination = operands[1];
+        int fd = open(archive.c_str(), O_RDONLY);
+        if (fd < 0) {
+            context.fail("unpack");
+            return;
+        }
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+        ArchiveReader reader(fd);
+        char magic[4];
+        if (!reader.read(magic, sizeof(magic)) || memcmp(magic, PackHeader::MAGIC, sizeof(magic)) != 0) {
+            cerr << "unpack: '" << archive << "' is not a pack archive" << endl;
+            context.failed = true;
+            close(fd);
+            return;
+        }
+
+        std::error_code error;
+        fs::create_directories(destination, error);
+        if (error) {
+            cerr << "unpack: " << destination << ": " << error.message() << endl;
+            context.failed = true;
+            close(fd);
+            return;
+        }
+
+        vector<thread> threads;
+        for (unsigned int i = 0; i < packWorkerCount(); ++i) {
+            threads.emplace_back([this]() {
+                writeFiles();
+            });
+        }
+
+        bool ok = readArchive(reader, destination);
+
+        {
+            std::lock_guard<std::mutex> lock(queueMutex);
+            readerDone = true;
+        }
+        queueChanged.notify_all();
+
+        // Join all threads
+        for (auto& thread : threads) {
+            thread.join();
+        }
+        close(fd);
+
+        // Children follow their parents in the archive, so restoring in reverse keeps every path reachable.
+        // The modes are set through the directory itself, so a name that became a symbolic link is never followed.
+        for (auto it = restrictedDirectories.rbegin(); it != restrictedDirectories.rend(); ++it) {
+            int directoryFd = open(it->first.c_str(), O_RDONLY | O_DIRECTORY | O_NOFOLLOW | O_CLOEXEC);
+            if (directoryFd < 0 || fchmod(directoryFd, it->second) != 0) {
+                context.fail("unpack");
+                failedEntries++;
+            }
+            if (directoryFd >= 0) {
+                close(directoryFd);
+            }
+        }
+
+        if (!ok && !context.stopped()) {
+            cerr << "unpack: '" << archive << "' is truncated or corrupt" << endl;
+            context.failed = true;
+        }
+        if (failedEntries > 0 && !context.stopped()) {
+            cerr << "unpack: " << failedEntries << (failedEntries == 1 ? " entry" : " entries") << " could not be unpacked"
+                 << endl;
+            context.failed = true;
+        }
+    }
+
+private:
+    // A small file whose data has been read and waits for a worker to create and write it
+    struct WriteTask {
+        string tempPath;
+        string finalPath;
+        unsigned int mode;
+        std::vector<char> data;
+    };
+
+    JobContext& context;
+
+    std::mutex queueMutex;
+    std::condition_variable queueChanged;
+    std::vector<WriteTask> pendingWrites;
+    unsigned long long queuedBytes = 0;
+    bool readerDone = false;
+    vector<pair<string, unsigned int>> restrictedDirectories;
+
+    // Paths below the destination already known to be real directories, so each is checked only once
+    std::unordered_set<string> verifiedDirectories;
+    std::atomic<unsigned long long> failedEntries{0};
+
+    // Function to display help information for unpack command
+    void displayUnpackHelp() {
+        cout << "unpack: Unpack an archive written by pack into a directory" << endl;
+        cout << "Usage: unpack <archive> <directory>" << endl;
+        cout << "Options:" << endl;
+        cout << "  --help\tDisplay help information" << endl;
+    }
+
+    // Function to reject absolute paths and '..' components that would escape the destination
+    static bool isSafePath(const string& path) {
+        fs::path entryPath(path);
+        if (path.empty() || entryPath.is_absolute()) {
+            return false;
+        }
+        for (const auto& component : entryPath) {
+            if (component == "..") {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Function to check that every directory leading to an entry is a real directory, and not a symbolic
+    // link that an earlier entry created to point outside the destination
+    bool hasSafeParents(const string& destination, const string& path) {
+        fs::path partial;
+        for (const auto& component : fs::path(path).parent_path()) {
+            partial /= component;
+            if (verifiedDirectories.count(partial.string()) > 0) {
+                continue;
+            }
+
+            // A missing parent is not an escape; creating the entry fails and is counted instead
+            struct stat parentStat;
+            if (lstat((fs::path(destination) / partial).c_str(), &parentStat) != 0) {
+                return errno == ENOENT;
+            }
+            if (!S_ISDIR(parentStat.st_mode)) {
+                return false;
+            }
+            verifiedDirectories.insert(partial.string());
+        }
+        return true;
+    }
+
+    // Function to create a file under its temporary name, preallocated so out-of-order writes still get
+    // contiguous space; O_NOFOLLOW keeps a symbolic link planted at the temporary name from being written through
+    int openTempFile(const string& tempPath, unsigned long long size) {
+        int fd = open(tempPath.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_NOFOLLOW | O_CLOEXEC, 0600);
+        if (fd < 0) {
+            context.fail("unpack");
+            failedEntries++;
+        } else if (size > 0) {
+            posix_fallocate(fd, 0, size);
+        }
+        return fd;
+    }
+
+    // Function to move a fully written file into place, or drop it if writing failed or the job stopped
+    void finishFile(int fd, const string& tempPath, const string& finalPath, unsigned int mode, bool ok) {
+        if (ok && fchmod(fd, mode) != 0) {
+            context.fail("unpack");
+        }
+        if (close(fd) != 0 && ok) {
+            context.fail("unpack");
+            ok = false;
+        }
+        if (!ok || context.stopped() || rename(tempPath.c_str(), finalPath.c_str()) != 0) {
+            if (ok && !context.stopped()) {
+                context.fail("unpack");
+            }
+            if (!context.stopped()) {
+                failedEntries++;
+            }
+            unlink(tempPath.c_str());
+            return;
+        }
+        context.filesDone++;
+    }
+
+    // Function to write a buffer at the given offset of a file
+    bool writeAll(int fd, const char* data, size_t length, off_t offset) {
+        while (length > 0) {
+            ssize_t written = pwrite(fd, data, length, offset);
+            if (written < 0) {
+                if (errno == EINTR) {
+                    continue;
+                }
+                context.fail("unpack");
+                return false;
+            }
+            data += written;
+            length -= written;
+            offset += written;
+            context.bytesDone += written;
+        }
+        return true;
+    }
+
+    // Function run by each writer thread until the reader has finished and the queue is empty
+    void writeFiles() {
+        while (true) {
+            WriteTask task;
+            {
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this] { return readerDone || !pendingWrites.empty(); });
+                if (pendingWrites.empty()) {
+                    return;
+                }
+                task = std::move(pendingWrites.back());
+                pendingWrites.pop_back();
+                queuedBytes -= task.data.size();
+            }
+            queueChanged.notify_all();
+
+            // Files are only opened here, so queued files hold no descriptors however small and many they are
+            if (context.stopped()) {
+                continue;
+            }
+            int fd = openTempFile(task.tempPath, task.data.size());
+            if (fd >= 0) {
+                bool ok = writeAll(fd, task.data.data(), task.data.size(), 0);
+                finishFile(fd, task.tempPath, task.finalPath, task.mode, ok);
             }
-        } else {
-            perror("ls");
         }
     }
 
-    // Function to list files recursively
-    void listFilesRecursively(const std::string& directory, bool reverseOrder, bool listSize, bool sortBySize) {
-        listFiles(directory, reverseOrder, listSize, sortBySize);
+    // Function to read entries in order, creating directories inline and handing small files to the writers
+    bool readArchive(ArchiveReader& reader, const string& destination) {
+        PackHeader header;
+        std::vector<char> buffer(1 << 20);
+        while (!context.stopped()) {
+            if (!reader.readHeader(header)) {
+                return false;
+            }
+            if (header.type == PackHeader::END) {
+                return true;
+            }
+            if (!isSafePath(header.path) || !hasSafeParents(destination, header.path)) {
+                cerr << "unpack: refusing unsafe path '" << header.path << "'" << endl;
+                context.failed = true;
+                return false;
+            }
+
+            const fs::path finalPath = fs::path(destination) / header.path;
+            if (header.type == PackHeader::DIRECTORY) {
+                // Directories stay writable until unpacking is done so their contents can be created
+                bool created = mkdir(finalPath.c_str(), header.mode | 0700) == 0;
+                if (!created && errno != EEXIST) {
+                    context.fail("unpack");
+                    failedEntries++;
+                    continue;
+                }
+
+                // An existing name is only reused if it really is a directory, never a symbolic link or a file
+                struct stat existingStat;
+                if (!created && (lstat(finalPath.c_str(), &existingStat) != 0 || !S_ISDIR(existingStat.st_mode))) {
+                    cerr << "unpack: '" << header.path << "' exists and is not a directory" << endl;
+                    context.failed = true;
+                    failedEntries++;
+                    continue;
+                }
+                if ((header.mode & 0700) != 0700) {
+                    restrictedDirectories.emplace_back(finalPath.string(), header.mode);
+                }
+                continue;
+            }
+
+            if (header.type == PackHeader::SYMLINK) {
+                // The size comes from the archive, so an impossible link target means a corrupt archive
+                if (header.size == 0 || header.size >= PATH_MAX) {
+                    return false;
+                }
+                string target(header.size, '\0');
+                if (!reader.read(&target[0], target.size())) {
+                    return false;
+                }
+                unlink(finalPath.c_str());
+                if (symlink(target.c_str(), finalPath.c_str()) != 0) {
+                    context.fail("unpack");
+                    failedEntries++;
+                }
+                continue;
+            }
+
+            if (header.type != PackHeader::REGULAR) {
+                return false;
+            }
 
-        // Vector to store threads
-        vector<thread> threads;
+            const string tempPath = finalPath.parent_path() / ("." + finalPath.filename().string() + ".unpack-tmp");
+            if (header.size <= PackHeader::SMALL_FILE_LIMIT) {
+                WriteTask task{tempPath, finalPath.string(), header.mode, std::vector<char>(header.size)};
+                if (!reader.read(task.data.data(), task.data.size())) {
+                    return false;
+                }
 
-        // Iterate over each file in the directory and list subdirectories recursively
-        for (const auto& entry : fs::directory_iterator(directory)) {
-            if (fs::is_directory(entry.path())) {
-                threads.emplace_back([this, &entry, &reverseOrder, &listSize, &sortBySize]() {
-                    cout << "Subdirectory: " << entry.path().filename() << endl;
-                    listFilesRecursively(entry.path(), reverseOrder, listSize, sortBySize);
+                std::unique_lock<std::mutex> lock(queueMutex);
+                queueChanged.wait(lock, [this, &header] {
+                    return queuedBytes == 0 || queuedBytes + header.size <= PackHeader::PIPELINE_LIMIT;
                 });
+                queuedBytes += task.data.size();
+                pendingWrites.push_back(std::move(task));
+                lock.unlock();
+                queueChanged.notify_all();
+                continue;
             }
-        }
 
-        // Join all threads
-        for (auto& thread : threads) {
-            thread.join();
+            // Large files are copied from the archive by this thread to keep the archive read sequential
+            int fd = openTempFile(tempPath, header.size);
+            unsigned long long remaining = header.size;
+            bool ok = fd >= 0;
+            off_t offset = 0;
+            while (remaining > 0) {
+                size_t chunk = min<unsigned long long>(buffer.size(), remaining);
+                if (!reader.read(buffer.data(), chunk)) {
+                    if (fd >= 0) {
+                        finishFile(fd, tempPath, finalPath.string(), header.mode, false);
+                    }
+                    return false;
+                }
+                ok = ok && !context.stopped() && writeAll(fd, buffer.data(), chunk, offset);
+                offset += chunk;
+                remaining -= chunk;
+            }
+            if (fd >= 0) {
+                finishFile(fd, tempPath, finalPath.string(), header.mode, ok);
+            }
         }
+        return false;
     }
 };
 
-class MvCommand {
+class CdCommand {
 public:
-    void execute(const vector<string>& args) {
-        bool forceOverwrite = false;
-        bool interactivePrompt = false;
+    explicit CdCommand(FileSystem& fileSystem) : fileSystem(fileSystem) {}
 
+    void execute(const vector<string>& args) {
         // Parse command-line options
         for (size_t i = 1; i < args.size(); ++i) {
-            if (args[i] == "-f") {
-                forceOverwrite = true;
-            } else if (args[i] == "-i") {
-                interactivePrompt = true;
-            } else if (args[i] == "--help") {
-                displayMvHelp();
-                return;
-            }
-        }
-
-        // Check for the correct number of arguments
-        if (args.size() < 3) {
-            cerr << "mv: missing source or destination file" << endl;
-            return;
-        }
-
-        const char* source = args[1].c_str();
-        const char* destination = args[2].c_str();
-
-        // Check if the destination file exists and if interactive prompt is enabled
-        if (interactivePrompt && access(destination, F_OK) == 0) {
-            char response;
-            cout << "mv: overwrite '" << destination << "'? (y/n): ";
-            cin >> response;
-
-            if (response != 'y') {
+            if (args[i] == "--help") {
+                displayCdHelp();
                 return;
             }
         }
 
-        // Perform the move operation
-        if (rename(source, destination) != 0) {
-            if (forceOverwrite) {
-                // If force overwrite is enabled, remove the destination file and try again
-                remove(destination);
-                if (rename(source, destination) != 0) {
-                    perror("mv");
-                }
-            } else {
-                perror("mv");
+        // Check if there is an argument provided
+        if (args.size() > 1) {
+            if (!fileSystem.changeDirectory(args[1])) {
+                perror("cd");
             }
+        } else {
+            cerr << "cd: missing argument" << endl;
         }
     }
 
 private:
-    // Function to display help information for mv command
-    void displayMvHelp() {
-        cout << "mv: Move or rename files" << endl;
-        cout << "Usage: mv [options] <source> <destination>" << endl;
+    FileSystem& fileSystem;
+
+    // Function to display help information for cd command
+    void displayCdHelp() {
+        cout << "cd: Change directory" << endl;
+        cout << "Usage: cd [options] <directory>" << endl;
         cout << "Options:" << endl;
-        cout << "  -f\tForce move by overwriting destination file without prompt" << endl;
-        cout << "  -i\tInteractive prompt before overwrite" << endl;
         cout << "  --help\tDisplay help information" << endl;
     }
 };
 
-class RmCommand {
+class GenCommand {
 public:
-    void execute(const vector<string>& args) {
-        bool interactivePrompt = false;
-        bool recursiveRemove = false;
+    GenCommand(JobContext& context, FileSystem& fileSystem) : context(context), fileSystem(fileSystem) {}
 
+    void execute(const vector<string>& args) {
         // Parse command-line options
         for (size_t i = 1; i < args.size(); ++i) {
-            if (args[i] == "-i") {
-                interactivePrompt = true;
-            } else if (args[i] == "--recursive") {
-                recursiveRemove = true;
-            } else if (args[i] == "--help") {
-                displayRmHelp();
+            if (args[i] == "--help") {
+                displayGenHelp();
                 return;
             }
         }
 
         // Check for the correct number of arguments
-        if (args.size() < 2) {
-            cerr << "rm: missing file operand" << endl;
+        if (args.size() < 5) {
+            cerr << "gen: missing directory, counts or file size" << endl;
+            context.failed = true;
             return;
         }
 
-        const char* file = args[1].c_str();
+        const string& directory = args[1];
+        int subdirectories = atoi(args[2].c_str());
+        int filesPerSubdirectory = atoi(args[3].c_str());
+        unsigned long long fileSize = strtoull(args[4].c_str(), nullptr, 10);
+        if (!fileSystem.makeDirectories(directory)) {
+            context.fail("gen");
+            return;
+        }
 
-        // Check if interactive prompt is enabled
-        if (interactivePrompt) {
-            char response;
-            cout << "rm: remove '" << file << "'? (y/n): ";
-            cin >> response;
+        TaskGroup tasks;
 
-            if (response != 'y') {
-                return;
-            }
-        }
+        // Each subdirectory is filled on its own thread, like the recursive commands traverse them
+        for (int i = 1; i <= subdirectories && !context.stopped(); ++i) {
+            tasks.run([this, &directory, i, filesPerSubdirectory, fileSize]() {
+                string subdirectory = directory + "/subdir" + to_string(i);
+                if (!fileSystem.makeDirectory(subdirectory, 0755) && errno != EEXIST) {
+                    context.fail("gen");
+                    return;
+                }
 
-        // Perform the remove operation
-        if (recursiveRemove) {
-            removeDirectory(file);
-        } else {
-            if (remove(file) != 0) {
-                perror("rm");
-            }
+                std::vector<char> buffer(min<unsigned long long>(fileSize, 1 << 20), 'x');
+                for (int j = 1; j <= filesPerSubdirectory && !context.stopped(); ++j) {
+                    writeFile(subdirectory + "/file" + to_string(j) + ".txt", buffer, fileSize);
+                }
+            });
         }
+
+        // Wait for all tasks
+        tasks.wait();
     }
 
 private:
-    // Function to display help information for rm command
-    void displayRmHelp() {
-        cout << "rm: Remove files or directories" << endl;
-        cout << "Usage: rm [options] <file>" << endl;
+    JobContext& context;
+    FileSystem& fileSystem;
+
+    // Function to display help information for gen command
+    void displayGenHelp() {
+        cout << "gen: Generate a test tree, like Q2.sh does for dir3, on the active backend" << endl;
+        cout << "Usage: gen <directory> <subdirectories> <files-per-subdirectory> <bytes-per-file>" << endl;
         cout << "Options:" << endl;
-        cout << "  -i\tPrompt before every removal" << endl;
-        cout << "  --recursive\tRemove directories and their contents recursively" << endl;
         cout << "  --help\tDisplay help information" << endl;
     }
 
-    // Function to remove a directory recursively
-    void removeDirectory(const std::string& path) {
-        vector<thread> threads;
-
-        // Iterate over each entry in the directory and remove it
-        for (const auto& entry : fs::directory_iterator(path)) {
-            threads.emplace_back([this, &entry]() {
-                const std::string& currentPath = entry.path();
-                if (fs::is_directory(currentPath)) {
-                    removeDirectory(currentPath);
-                } else {
-                    if (remove(currentPath.c_str()) != 0) {
-                        perror("rm");
-                    }
-                }
-            });
-        }
-
-        // Join all threads
-        for (auto& thread : threads) {
-            thread.join();
+    // Function to write a file of the given size from a repeated buffer
+    void writeFile(const string& path, const std::vector<char>& buffer, unsigned long long size) {
+        std::unique_ptr<FileHandle> file = fileSystem.open(path, FileSystem::OpenMode::Write);
+        if (!file) {
+            context.fail("gen");
+            return;
         }
-
-        // Remove the main directory after its contents have been removed
-        if (remove(path.c_str()) != 0) {
-            perror("rm");
+        while (size > 0) {
+            ssize_t written = file->write(buffer.data(), min<unsigned long long>(buffer.size(), size));
+            if (written <= 0) {
+                context.fail("gen");
+                break;
+            }
+            size -= written;
+            context.bytesDone += written;
         }
+        file->close();
+        context.filesDone++;
     }
 };
 
-class CpCommand {
+// A command line running on its own thread after being started with '&'
+struct Job {
+    int id;
+    std::string commandLine;
+    JobContext context;
+    std::atomic<bool> finished{false};
+    std::thread worker;
+};
+
+// Context of the foreground command, stopped by Ctrl-C
+static std::atomic<JobContext*> foregroundContext{nullptr};
+
+// Function to handle SIGINT by asking the foreground command to stop
+static void handleInterrupt(int) {
+    JobContext* context = foregroundContext.load();
+    if (context != nullptr) {
+        context->stopRequested.store(true);
+    }
+}
+
+class Shell {
 public:
-    void execute(const std::vector<std::string>& args) {
-        // Parse command-line options
-        bool recursiveCopy = false;
-        for (size_t i = 1; i < args.size(); ++i) {
-            if (args[i] == "--help") {
-                displayCpHelp();
-                return;
-            } else if (args[i] == "-r" || args[i] == "--recursive") {
-                recursiveCopy = true;
+    explicit Shell(FileSystem& fileSystem) : fileSystem(fileSystem), purger(fileSystem, trashRegistryPath(fileSystem)) {}
+
+    void run() {
+        // Ctrl-C cancels the foreground command instead of killing the shell
+        struct sigaction action {};
+        action.sa_handler = handleInterrupt;
+        action.sa_flags = SA_RESTART;
+        sigemptyset(&action.sa_mask);
+        sigaction(SIGINT, &action, nullptr);
+
+        string input;
+        while (true) {
+            cout << "> ";
+            if (!getline(cin, input)) {
+                break;
             }
-        }
 
-        // Check for the correct number of arguments
-        if (args.size() < 3) {
-            std::cerr << "cp: missing source or destination file" << std::endl;
-            return;
-        }
+            // Tokenize the input into a vector of strings
+            istringstream iss(input);
+            vector<string> args{
+                istream_iterator<string>{iss},
+                istream_iterator<string>{}
+            };
 
-        const std::string& source = args[1];
-        const std::string& destination = args[2];
+            // The jobs listing shows finished jobs itself before forgetting them
+            if (args.empty() || args[0] != "jobs") {
+                reportFinishedJobs();
+            }
 
-        // Check if the source is a directory
-        if (fs::is_directory(source)) {
-            copyDirectory(source, destination, recursiveCopy);
-        } else {
-            copyFile(source, destination);
+            // A trailing '&' runs the command in the background
+            bool background = false;
+            if (!args.empty() && args.back().back() == '&') {
+                background = true;
+                args.back().pop_back();
+                if (args.back().empty()) {
+                    args.pop_back();
+                }
+            }
+
+            // Check if the 'exit' command is given to exit the shell
+            if (!args.empty() && args[0] == "exit") {
+                break;
+            }
+
+            // Check if there is any valid command to execute
+            if (args.empty()) {
+                continue;
+            }
+
+            if (args[0] == "jobs") {
+                listJobs();
+            } else if (args[0] == "cd" && hasRunningJobs()) {
+                // Background jobs resolve their relative operands against the shell's working directory
+                cerr << "cd: cannot change directory while background jobs are running" << endl;
+            } else if (args[0] == "time") {
+                timeCommand(args);
+            } else if (args[0] == "kill") {
+                cancelJob(args);
+            } else if (background) {
+                startJob(args, input);
+            } else {
+                runForeground(args);
+            }
+        }
+
+        // Stop background jobs and wait for them so no half-written files are left behind
+        for (auto& job : jobs) {
+            job->context.stopRequested = true;
+        }
+        for (auto& job : jobs) {
+            job->worker.join();
         }
     }
 
 private:
-    // Function to display help information for cp command
-    void displayCpHelp() {
-        std::cout << "cp: Copy files" << std::endl;
-        std::cout << "Usage: cp [options] <source> <destination>" << std::endl;
-        std::cout << "Options:" << std::endl;
-        std::cout << "  -r, --recursive\tCopy directories recursively" << std::endl;
-        std::cout << "  --help\tDisplay help information" << std::endl;
-    }
+    FileSystem& fileSystem;
 
-    // Function to copy a file
-    void copyFile(const std::string& source, const std::string& destination) {
-        std::ifstream sourceFile(source, std::ios::binary);
-        std::ofstream destFile(destination, std::ios::binary);
+    // Declared before the jobs so background rm jobs never outlive it
+    TrashPurger purger;
+    vector<unique_ptr<Job>> jobs;
+    int nextJobId = 1;
 
-        destFile << sourceFile.rdbuf();
+    // Function to locate the list of trash directories; backends that vanish with the shell keep none
+    static string trashRegistryPath(FileSystem& fileSystem) {
+        const char* home = getenv("HOME");
+        if (strcmp(fileSystem.name(), "posix") != 0) {
+            return "";
+        }
+        return string(home != nullptr ? home : ".") + "/.shell-trash-dirs";
     }
 
-    // Function to copy a directory
-    void copyDirectory(const std::string& source, const std::string& destination, bool recursive) {
-        // Create the destination directory if it doesn't exist
-        fs::create_directories(destination);
+    // Function to execute a single command with the given job context
+    void executeCommand(const vector<string>& args, JobContext& context) {
+        const char* command = args[0].c_str();
 
-        vector<thread> threads;
+        // pack and unpack stream archives with POSIX calls and have no in-memory equivalent
+        if ((strcmp(command, "pack") == 0 || strcmp(command, "unpack") == 0) &&
+            strcmp(fileSystem.name(), "posix") != 0) {
+            cerr << command << ": not available with the " << fileSystem.name() << " backend" << endl;
+            return;
+        }
 
-        // Iterate over each file in the source directory and copy it to the destination
-        for (const auto& entry : fs::directory_iterator(source)) {
-            threads.emplace_back([this, &entry, &destination, &recursive]() {
-                const std::string& sourceFile = entry.path();
-                const std::string& destFile = fs::path(destination) / entry.path().filename();
+        // Execute the corresponding command based on the input
+        if (strcmp(command, "ls") == 0) {
+            LsCommand lsCommand(context, fileSystem);
+            lsCommand.execute(args);
+        } else if (strcmp(command, "mv") == 0) {
+            MvCommand mvCommand(context, fileSystem);
+            mvCommand.execute(args);
+        } else if (strcmp(command, "rm") == 0) {
+            RmCommand rmCommand(context, fileSystem, purger);
+            rmCommand.execute(args);
+        } else if (strcmp(command, "cp") == 0) {
+            CpCommand cpCommand(context, fileSystem);
+            cpCommand.execute(args);
+        } else if (strcmp(command, "gen") == 0) {
+            GenCommand genCommand(context, fileSystem);
+            genCommand.execute(args);
+        } else if (strcmp(command, "pack") == 0) {
+            PackCommand packCommand(context);
+            packCommand.execute(args);
+        } else if (strcmp(command, "unpack") == 0) {
+            UnpackCommand unpackCommand(context);
+            unpackCommand.execute(args);
+        } else if (strcmp(command, "cd") == 0) {
+            CdCommand cdCommand(fileSystem);
+            cdCommand.execute(args);
+        } else {
+            cerr << "Command not recognized: " << command << endl;
+        }
+    }
 
-                // Recursively copy directories if the option is enabled
-                if (fs::is_directory(sourceFile) && recursive) {
-                    copyDirectory(sourceFile, destFile, true);
-                } else {
-                    copyFile(sourceFile, destFile);
+    // Function to run a command in the foreground, reporting progress of long copies and removals
+    void runForeground(const vector<string>& args) {
+        JobContext context;
+        foregroundContext = &context;
+
+        std::mutex reporterMutex;
+        std::condition_variable reporterDone;
+        bool commandFinished = false;
+        bool reported = false;
+
+        // Other commands write to stdout, where a progress line would interleave with their output; logs get no escapes
+        std::thread reporter;
+        bool progressCommand =
+            args[0] == "cp" || args[0] == "rm" || args[0] == "pack" || args[0] == "unpack" || args[0] == "gen";
+        if (progressCommand && isatty(STDERR_FILENO)) {
+            reporter = std::thread([&]() {
+                std::unique_lock<std::mutex> lock(reporterMutex);
+                while (!reporterDone.wait_for(lock, std::chrono::seconds(1), [&] { return commandFinished; })) {
+                    cerr << "\r" << args[0] << ": " << context.progress() << "\033[K" << flush;
+                    reported = true;
+                }
+                if (reported) {
+                    cerr << "\r\033[K" << flush;
                 }
             });
         }
 
-        // Join all threads
-        for (auto& thread : threads) {
-            thread.join();
+        executeCommand(args, context);
+
+        if (reporter.joinable()) {
+            {
+                std::lock_guard<std::mutex> lock(reporterMutex);
+                commandFinished = true;
+            }
+            reporterDone.notify_one();
+            reporter.join();
+        }
+
+        foregroundContext = nullptr;
+        cerr << context.summary;
+        if (context.stopped()) {
+            cerr << args[0] << ": cancelled" << endl;
         }
     }
-};
 
-// ... (CdCommand, Shell, main function remain the same)
+    // Function to run the rest of the line in the foreground and report its wall-clock time
+    void timeCommand(const vector<string>& args) {
+        if (args.size() < 2) {
+            cerr << "time: missing command" << endl;
+            return;
+        }
 
+        auto start = std::chrono::steady_clock::now();
+        runForeground(vector<string>(args.begin() + 1, args.end()));
+        double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        fprintf(stderr, "real %.3fs\n", seconds);
+    }
 
-class CdCommand {
-public:
-    void execute(const vector<string>& args) {
-        // ... (unchanged code)
+    // Function to start a command on a background thread
+    void startJob(const vector<string>& args, const string& input) {
+        if (args[0] == "cd") {
+            cerr << "cd: cannot run in the background" << endl;
+            return;
+        }
+
+        auto job = std::make_unique<Job>();
+        job->id = nextJobId++;
+        job->commandLine = input;
+        Job* started = job.get();
+        job->worker = std::thread([this, started, args]() {
+            executeCommand(args, started->context);
+            started->finished = true;
+        });
+
+        cout << "[" << started->id << "] started" << endl;
+        jobs.push_back(std::move(job));
     }
 
-private:
-    // ... (unchanged code)
-};
+    // Function to check whether any background job is still running
+    bool hasRunningJobs() const {
+        for (const auto& job : jobs) {
+            if (!job->finished) {
+                return true;
+            }
+        }
+        return false;
+    }
 
-class Shell {
-public:
-    void run() {
-        string input;
-        while (true) {
-            cout << "> ";
-            getline(cin, input);
+    // Function to describe the state of a job, given whether it had finished when it was looked at
+    static const char* jobStatus(const Job& job, bool finished) {
+        if (finished) {
+            return job.context.stopped() ? "Cancelled" : job.context.failed ? "Failed" : "Done";
+        }
+        return job.context.stopped() ? "Stopping" : "Running";
+    }
 
-            // Tokenize the input into a vector of strings
-            istringstream iss(input);
-            vector<string> args{
-                istream_iterator<string>{iss},
-                istream_iterator<string>{}
-            };
+    // Function to list background jobs with their progress; finished jobs are listed once and then forgotten
+    void listJobs() {
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            Job& job = **it;
+            bool finished = job.finished;
+            cout << "[" << job.id << "] " << jobStatus(job, finished) << "\t" << job.context.progress() << "\t"
+                 << job.commandLine << endl;
+            if (finished) {
+                job.worker.join();
+                cerr << job.context.summary;
+                it = jobs.erase(it);
+            } else {
+                ++it;
+            }
+        }
+    }
 
-            // Check if the 'exit' command is given to exit the shell
-            if (!args.empty() && args[0] == "exit") {
-                break;
+    // Function to print and forget jobs that finished since the last prompt
+    void reportFinishedJobs() {
+        for (auto it = jobs.begin(); it != jobs.end();) {
+            Job& job = **it;
+            if (job.finished) {
+                job.worker.join();
+                cout << "[" << job.id << "] " << jobStatus(job, true) << "\t" << job.commandLine << endl;
+                cerr << job.context.summary;
+                it = jobs.erase(it);
+            } else {
+                ++it;
             }
+        }
+    }
 
-            // Check if there is any valid command to execute
-            if (!args.empty()) {
-                const char* command = args[0].c_str();
-
-                // Execute the corresponding command based on the input
-                if (strcmp(command, "ls") == 0) {
-                    LsCommand lsCommand;
-                    lsCommand.execute(args);
-                } else if (strcmp(command, "mv") == 0) {
-                    MvCommand mvCommand;
-                    mvCommand.execute(args);
-                } else if (strcmp(command, "rm") == 0) {
-                    RmCommand rmCommand;
-                    rmCommand.execute(args);
-                } else if (strcmp(command, "cp") == 0) {
-                    CpCommand cpCommand;
-                    cpCommand.execute(args);
-                } else if (strcmp(command, "cd") == 0) {
-                    CdCommand cdCommand;
-                    cdCommand.execute(args);
-                } else {
-                    cerr << "Command not recognized: " << command << endl;
-                }
+    // Function to request cancellation of a background job given as %N or N
+    void cancelJob(const vector<string>& args) {
+        if (args.size() < 2) {
+            cerr << "kill: missing job id" << endl;
+            return;
+        }
+
+        string id = args[1];
+        if (!id.empty() && id[0] == '%') {
+            id.erase(0, 1);
+        }
+        for (auto& job : jobs) {
+            if (to_string(job->id) == id) {
+                job->context.stopRequested = true;
+                return;
             }
         }
+        cerr << "kill: no such job: " << args[1] << endl;
     }
 };
 
-int main() {
-    Shell shell;
+int main(int argc, char* argv[]) {
+    // --vfs=memory[:LATENCY_US] runs the shell on an in-memory filesystem instead of the real one
+    unique_ptr<FileSystem> fileSystem = make_unique<PosixFileSystem>();
+    for (int i = 1; i < argc; ++i) {
+        string arg = argv[i];
+        if (arg == "--vfs=posix") {
+            fileSystem = make_unique<PosixFileSystem>();
+        } else if (arg.rfind("--vfs=memory", 0) == 0 && (arg.size() == 12 || arg[12] == ':')) {
+            long latency = arg.size() > 12 ? atol(arg.c_str() + 13) : 0;
+            fileSystem = make_unique<MemoryFileSystem>(std::chrono::microseconds(latency));
+        } else {
+            cerr << "Usage: " << argv[0] << " [--vfs=posix|--vfs=memory[:LATENCY_US]]" << endl;
+            return 1;
+        }
+    }
+
+    Shell shell(*fileSystem);
     shell.run();
 
     return 0;